@@ -0,0 +1,235 @@
+#include "GameBoard.h"
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <string>
+
+using namespace std;
+using namespace std::chrono;
+
+// A large paste, mostly text with the odd escape sequence mixed in, as when a
+// level file is pasted into a game, fed to the decoder a byte at a time.
+static string PastedInput(size_t byteCount) {
+  const string text = "The quick brown fox jumps over the lazy dog.\n";
+  const string sequences[] = {"\x1B[A", "\x1B[1;5C", "\x1B[15~", "\x1BOP"};
+
+  string input;
+  input.reserve(byteCount + 16);
+  input += "\x1B[200~";
+  for (size_t i = 0; input.size() < byteCount; ++i) {
+    input += text;
+    input += sequences[i % size(sequences)];
+  }
+  input += "\x1B[201~";
+
+  return input;
+}
+
+static void BenchmarkKeyDecoder(const string &input, const char *name) {
+  const int repeatCount = 10;
+
+  size_t keyCount = 0;
+  unsigned checksum = 0;
+  auto start = steady_clock::now();
+
+  for (int repeat = 0; repeat < repeatCount; ++repeat) {
+    KeyDecoder decoder;
+    for (size_t i = 0; i < input.size();) {
+      char key;
+      if (decoder.decode(input[i], key)) {
+        ++i;
+      }
+      if (key != GameBoard::noKey) {
+        ++keyCount;
+        checksum += (unsigned char)key;
+      }
+    }
+  }
+
+  double seconds = duration<double>(steady_clock::now() - start).count();
+  double megabytes = double(input.size()) * repeatCount / 1e6;
+  cout << name << ": " << megabytes / seconds << " MB/s, "
+       << keyCount / seconds / 1e6 << " M keys/s (checksum " << checksum
+       << ")" << endl;
+}
+
+// Counts what would be written to a terminal, and discards it, so only the
+// cost of composing frames is measured. Every escape sequence starts with an
+// escape char, and glyphs never are one, so counting them counts sequences.
+class CountingSink : public RenderSink {
+public:
+  uint64_t byteCount = 0;
+  uint64_t escapeCount = 0;
+
+  void write(string_view frame) override {
+    byteCount += frame.size();
+    escapeCount += count(frame.begin(), frame.end(), '\x1B');
+  }
+};
+
+// A workload changes a board before each frame, e.g. moving a snake.
+using RenderWorkload = function<void(GameBoard &board, int frame)>;
+
+// Draws frameCount frames of a workload, reporting the time, bytes and escape
+// sequences per frame. Frames are drawn with updateConsole, or redrawConsole.
+// A HeadlessTerminal checks the same frames draw the board correctly first.
+static void BenchmarkRender(const char *name, int rowCount, int colCount,
+                            const RenderWorkload &workload, bool redraw = false,
+                            int frameCount = 2000) {
+  {
+    GameBoard board(rowCount, colCount);
+    HeadlessTerminal terminal(rowCount + 20, 2 * colCount + 10);
+    board.setRenderSink(&terminal);
+    for (int frame = 0; frame < 50; ++frame) {
+      workload(board, frame);
+      redraw ? board.redrawConsole() : board.updateConsole();
+      if (!board.screenMatches(terminal)) {
+        cout << name << ": MISMATCH at frame " << frame << endl;
+        return;
+      }
+    }
+  }
+
+  GameBoard board(rowCount, colCount);
+  CountingSink sink;
+  board.setRenderSink(&sink);
+  board.updateConsole();
+  sink.byteCount = sink.escapeCount = 0;
+
+  // The workload is timed too, e.g. logging, along with drawing the frame.
+  auto start = steady_clock::now();
+  for (int frame = 0; frame < frameCount; ++frame) {
+    workload(board, frame);
+    redraw ? board.redrawConsole() : board.updateConsole();
+  }
+  nanoseconds elapsed = steady_clock::now() - start;
+
+  cout << name << " (" << rowCount << "x" << colCount << "): "
+       << elapsed.count() / frameCount << " ns/frame, "
+       << sink.byteCount / frameCount << " bytes/frame, "
+       << double(sink.escapeCount) / frameCount << " escapes/frame" << endl;
+}
+
+// A snake crawling around the board, so each frame changes a few tiles.
+static void SnakeWorkload(GameBoard &board, int frame) {
+  const int length = 20;
+  auto position = [&](int step) {
+    int perimeter = 2 * (board.rowCount() + board.colCount()) - 4;
+    int i = step % perimeter;
+    int top = board.colCount() - 1;
+    int right = top + board.rowCount() - 1;
+    int bottom = right + board.colCount() - 1;
+    if (i < top) {
+      return pair(0, i);
+    } else if (i < right) {
+      return pair(i - top, board.colCount() - 1);
+    } else if (i < bottom) {
+      return pair(board.rowCount() - 1, board.colCount() - 1 - (i - right));
+    }
+    return pair(board.rowCount() - 1 - (i - bottom), 0);
+  };
+
+  if (frame >= length) {
+    auto [tailRow, tailCol] = position(frame - length);
+    board.clearTileAt(tailRow, tailCol);
+  }
+  auto [row, col] = position(frame);
+  board.setTileAt(row, col, '@', Color::green);
+  board.setHighlightedCoords(row, col);
+}
+
+// Every tile changes every frame.
+static void ChurnWorkload(GameBoard &board, int frame) {
+  for (int row = 0; row < board.rowCount(); ++row) {
+    for (int col = 0; col < board.colCount(); ++col) {
+      int i = row + col + frame;
+      board.setTileAt(row, col, char('a' + i % 26), Color(1 + i % 11));
+    }
+  }
+}
+
+// About 1% of the tiles change each frame, scattered at random.
+static void SparseWorkload(GameBoard &board, int /*frame*/) {
+  static mt19937 random;
+  int changeCount = max(1, board.rowCount() * board.colCount() / 100);
+  for (int i = 0; i < changeCount; ++i) {
+    int row = random() % board.rowCount();
+    int col = random() % board.colCount();
+    if (random() % 4 == 0) {
+      board.clearTileAt(row, col);
+    } else {
+      board.setTileAt(row, col, char('A' + random() % 26), Color(1 + random() % 11));
+    }
+  }
+}
+
+// Only the highlighted coords change.
+static void HighlightWorkload(GameBoard &board, int frame) {
+  board.setHighlightedCoords(frame % board.rowCount(),
+                             (frame * 7) % board.colCount());
+}
+
+// Several lines logged, and the message set, each frame.
+static void LoggingWorkload(GameBoard &board, int frame) {
+  board.setTileAt(frame % board.rowCount(), frame % board.colCount(), '*',
+                  Color::yellow);
+  for (int i = 0; i < 5; ++i) {
+    board << "frame " << frame << " event " << i << endl;
+  }
+  board.setMessage("frame " + to_string(frame));
+}
+
+// Sprites walking over a static map, on their own layer above the terrain and
+// items, so each frame redraws only the tiles they leave and enter.
+static void SpritesWorkload(GameBoard &board, int frame) {
+  const int terrainLayer = 0, itemLayer = 1, spriteLayer = 2;
+  const int spriteCount = board.rowCount() / 2;
+  auto spriteCol = [&](int sprite, int frame) {
+    return (frame + sprite * 7) % board.colCount();
+  };
+
+  if (frame == 0) {
+    board.setLayerCount(3);
+    for (int row = 0; row < board.rowCount(); ++row) {
+      for (int col = 0; col < board.colCount(); ++col) {
+        bool wall = row % 8 == 0 && col % 5 != 0;
+        board.setLayerTileAt(terrainLayer, row, col,
+                             wall ? Tile('#', Color::gray)
+                                  : Tile('.', Color::green));
+        if ((row * 7 + col * 3) % 23 == 0) {
+          board.setLayerTileAt(itemLayer, row, col, Tile('$', Color::yellow));
+        }
+      }
+    }
+    for (int sprite = 0; sprite < spriteCount; ++sprite) {
+      board.setLayerTileAt(spriteLayer, 2 * sprite + 1, spriteCol(sprite, 0),
+                           Tile('@', Color::red));
+    }
+    return;
+  }
+
+  for (int sprite = 0; sprite < spriteCount; ++sprite) {
+    board.moveLayerTile(spriteLayer, 2 * sprite + 1,
+                        spriteCol(sprite, frame - 1), 2 * sprite + 1,
+                        spriteCol(sprite, frame));
+  }
+}
+
+void BenchmarkTestMain() {
+  string input = PastedInput(16 << 20);
+
+  BenchmarkKeyDecoder(input, "KeyDecoder bracketed paste");
+  BenchmarkKeyDecoder(input.substr(6, input.size() - 12), "KeyDecoder unbracketed");
+
+  BenchmarkRender("snake update", 40, 40, SnakeWorkload);
+  BenchmarkRender("churn update", 50, 50, ChurnWorkload, false, 200);
+  BenchmarkRender("churn redraw", 50, 50, ChurnWorkload, true, 200);
+  BenchmarkRender("sparse update", 50, 50, SparseWorkload);
+  BenchmarkRender("sparse redraw", 50, 50, SparseWorkload, true, 200);
+  BenchmarkRender("highlight update", 40, 40, HighlightWorkload);
+  BenchmarkRender("logging update", 40, 40, LoggingWorkload);
+  BenchmarkRender("sprites update", 40, 40, SpritesWorkload);
+}
@@ -2,28 +2,164 @@
 
 #include "GameBoard.h"
 
+#include <poll.h>
+#include <signal.h>
 #include <termios.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <charconv>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
 #include <exception>
 #include <limits>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
 
 using namespace std;
+using namespace std::chrono;
 
 enum {
-  kMaxRowCount = 50,
-  kMaxColCount = 50,
+  // Larger boards are displayed through a viewport no bigger than this, until
+  // setViewportSize says otherwise.
+  kDefaultMaxViewportRowCount = 50,
+  kDefaultMaxViewportColCount = 50,
 };
 
 enum : int {
   kIllegalCoord = std::numeric_limits<int>::max(),
 };
 
-GameBoard::GameBoard(int rowCount, int colCount) {
-  if (rowCount < 0 || colCount < 0 || rowCount > kMaxRowCount ||
-      colCount > kMaxColCount) {
-    throw std::out_of_range("GameBoard:: rowCount & colCount must be 1..50");
+enum {
+  // How long to wait for the rest of an escape sequence, before deciding the
+  // escape key was pressed on its own.
+  kEscapeTimeoutMillis = 50,
+
+  // How many ticks a GameLoop runs back to back to catch up, before dropping
+  // the rest.
+  kMaxCatchUpTickCount = 5,
+
+  // Frames with fewer tiles to draw than this per thread are composed on
+  // fewer threads, the handoff costing more than the tiles.
+  kMinEncodingBandTileCount = 2048,
+};
+
+enum : unsigned char {
+  // Display attributes beyond the Color constants.
+  kDimAttributes = Color::gray + 1, // the empty tile dot
+  kUnknownAttributes = 0xFF,
+};
+
+// Frames are composed into a byte buffer with these helpers, rather than
+// printed piecemeal through cout/printf, so each frame costs a single write.
+
+static void appendNumber(string &frame, int value, int width = 0,
+                         bool leftAlign = false) {
+  char digits[16];
+  char *end = to_chars(digits, digits + sizeof(digits), value).ptr;
+  int padding = width - int(end - digits);
+
+  if (!leftAlign && padding > 0) {
+    frame.append(padding, ' ');
+  }
+  frame.append(digits, end);
+  if (leftAlign && padding > 0) {
+    frame.append(padding, ' ');
+  }
+}
+
+static void appendCursorPosition(string &frame, int vt100Row, int vt100Col) {
+  frame += "\x1B[";
+  appendNumber(frame, vt100Row);
+  frame += ';';
+  appendNumber(frame, vt100Col);
+  frame += 'H';
+}
+
+static int numberLength(int value) {
+  int length = 1;
+  for (; value > 9; value /= 10) {
+    ++length;
+  }
+  return length;
+}
+
+// The byte cost of CUU/CUD/CUF/CUB (\x1B[{n}A..D); a count of one is implied.
+static int relativeMoveCost(int count) {
+  return count == 1 ? 3 : 3 + numberLength(count);
+}
+
+static void appendRelativeMove(string &frame, int count, char direction) {
+  frame += "\x1B[";
+  if (count != 1) {
+    appendNumber(frame, count);
+  }
+  frame += direction;
+}
+
+// Calls changed(i) for each i < count where the tiles in the glyph & color
+// planes differ. With SSE2/AVX2 available, 16/32 tiles are compared at once.
+template <typename F>
+static void diffTiles(const char *glyphs, const Color *colors,
+                      const char *otherGlyphs, const Color *otherColors,
+                      int count, F changed) {
+  int i = 0;
+
+#if defined(__AVX2__)
+  for (; i + 32 <= count; i += 32) {
+    __m256i glyphsEqual = _mm256_cmpeq_epi8(
+        _mm256_loadu_si256((const __m256i *)(glyphs + i)),
+        _mm256_loadu_si256((const __m256i *)(otherGlyphs + i)));
+    __m256i colorsEqual = _mm256_cmpeq_epi8(
+        _mm256_loadu_si256((const __m256i *)(colors + i)),
+        _mm256_loadu_si256((const __m256i *)(otherColors + i)));
+    uint32_t mask = ~uint32_t(
+        _mm256_movemask_epi8(_mm256_and_si256(glyphsEqual, colorsEqual)));
+    for (; mask != 0; mask &= mask - 1) {
+      changed(i + __builtin_ctz(mask));
+    }
+  }
+#endif
+
+#if defined(__SSE2__)
+  for (; i + 16 <= count; i += 16) {
+    __m128i glyphsEqual =
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(glyphs + i)),
+                       _mm_loadu_si128((const __m128i *)(otherGlyphs + i)));
+    __m128i colorsEqual =
+        _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(colors + i)),
+                       _mm_loadu_si128((const __m128i *)(otherColors + i)));
+    uint32_t mask =
+        ~_mm_movemask_epi8(_mm_and_si128(glyphsEqual, colorsEqual)) & 0xFFFF;
+    for (; mask != 0; mask &= mask - 1) {
+      changed(i + __builtin_ctz(mask));
+    }
+  }
+#endif
+
+  for (; i < count; ++i) {
+    if (glyphs[i] != otherGlyphs[i] || colors[i] != otherColors[i]) {
+      changed(i);
+    }
+  }
+}
+
+GameBoard::GameBoard(int rowCount, int colCount)
+    : GameBoard(rowCount, colCount, nullptr, nullptr) {}
+
+GameBoard::GameBoard(int rowCount, int colCount, char *glyphs, Color *colors) {
+  if (rowCount < 0 || colCount < 0) {
+    throw std::out_of_range("GameBoard:: rowCount & colCount can't be negative");
   }
   _rowCount = rowCount;
   _colCount = colCount;
@@ -32,12 +168,34 @@ GameBoard::GameBoard(int rowCount, int colCount) {
   _highlightedCol = kIllegalCoord;
   _dirtyHighlightedRow = kIllegalCoord;
   _dirtyHighlightedCol = kIllegalCoord;
+  _encoding.cursorRow = kIllegalCoord;
+  _encoding.cursorCol = kIllegalCoord;
+  _encoding.attributes = kUnknownAttributes;
   _highlightedCoordsColor = Color::blue;
+  setRenderSink(nullptr);
+  compileKeyBindings();
+  _logLines.resize(_logLineCount);
+
+  _ownsTiles = glyphs == nullptr;
+  if (_ownsTiles) {
+    size_t tileCount = size_t(_rowCount) * _colCount;
+    _glyphs = new char[tileCount]();
+    _colors = new Color[tileCount]();
+  } else {
+    _glyphs = glyphs;
+    _colors = colors;
+  }
 
-  _tiles = new Tile[_rowCount * _colCount]();
+  setViewportSize(min<int>(_rowCount, kDefaultMaxViewportRowCount),
+                  min<int>(_colCount, kDefaultMaxViewportColCount));
 }
 
-GameBoard::~GameBoard() { delete[] _tiles; }
+GameBoard::~GameBoard() {
+  if (_ownsTiles) {
+    delete[] _glyphs;
+    delete[] _colors;
+  }
+}
 
 void GameBoard::setDisplayCoords(bool displayCoords) {
   _redrawNeeded = true;
@@ -58,6 +216,42 @@ void GameBoard::setDisplayEmptyTileDots(bool displayEmptyTileDots) {
   _displayEmptyTileDots = displayEmptyTileDots;
 }
 
+void GameBoard::setViewport(int row, int col) {
+  // Clamped so the viewport never extends past the edges of the board.
+  row = max(0, min(row, _rowCount - _viewportRowCount));
+  col = max(0, min(col, _colCount - _viewportColCount));
+
+  if (row != _viewportRow || col != _viewportCol) {
+    _viewportRow = row;
+    _viewportCol = col;
+    _viewportMoved = true;
+    setRowsStale(_viewportRow, _viewportRowCount);
+  }
+}
+
+void GameBoard::setViewportSize(int rowCount, int colCount) {
+  if (rowCount < 0 || colCount < 0 || rowCount > _rowCount ||
+      colCount > _colCount) {
+    throw std::out_of_range("GameBoard:: illegal viewport rowCount(" +
+                            to_string(rowCount) + ") or colCount(" +
+                            to_string(colCount) + ")");
+  }
+  _redrawNeeded = true;
+  _viewportRowCount = rowCount;
+  _viewportColCount = colCount;
+
+  // Everything tracked per displayed tile is sized by the viewport, not the
+  // board, so large boards cost no more to draw than small ones.
+  unsigned viewportTileCount = rowCount * colCount;
+  _consoleGlyphs.assign(viewportTileCount, '\0');
+  _consoleColors.assign(viewportTileCount, Color::defaultColor);
+  _dirtyBits.assign((viewportTileCount + 63) / 64, 0);
+  _dirtyTileIndexes.clear();
+  _staleRowBits.assign((rowCount + 63) / 64, 0);
+
+  setViewport(_viewportRow, _viewportCol);
+}
+
 string GameBoard::message(int messageLineNumber) const {
   if (messageLineNumber < 0 || messageLineNumber > 1) {
     throw std::out_of_range("GameBoard:: illegal message line number:" +
@@ -74,61 +268,107 @@ void GameBoard::setMessage(string newMessage, int messageLineNumber) {
 
   auto newLineCount = std::count(newMessage.begin(), newMessage.end(), '\n');
 
+  // The message is drawn by the next updateConsole, and only if it changed.
+  auto setMessageLine = [this](int lineNumber, string_view message) {
+    if (_messageLines[lineNumber] != message) {
+      _messageLines[lineNumber] = message;
+      _messageDirty = true;
+    }
+  };
+
   if (messageLineNumber == 0) {
     if (newLineCount > 1) {
       throw std::out_of_range(
           "GameBoard:: illegal message: only one newline allowed.");
     } else if (newLineCount == 0) {
-      _messageLines[0] = newMessage;
+      setMessageLine(0, newMessage);
     } else {
       // A message for line zero containing a _single_ newline is interpreted as
       // two messages.
       size_t index = newMessage.find('\n');
-      _messageLines[0] = newMessage.substr(0, index);
-      _messageLines[1] = newMessage.substr(index + 1);
+      setMessageLine(0, string_view(newMessage).substr(0, index));
+      setMessageLine(1, string_view(newMessage).substr(index + 1));
     }
   } else {
     if (newLineCount > 0) {
       throw std::out_of_range(
           "GameBoard:: illegal message: newlines not allowed.");
     }
-    _messageLines[1] = newMessage;
+    setMessageLine(1, newMessage);
   }
-
-  drawMessage();
 }
 
-void GameBoard::log(vector<string> strings) {
-  for (int i = 0; i < strings.size(); i++) {
-    _logLines.push_back(strings[i]);
-    if (_logLines.size() > _logLineCount) {
-      _logLines.erase(_logLines.begin());
-    }
+void GameBoard::addLogLine(string_view line) {
+  if (_logLines.empty()) {
+    return;
   }
-  drawLog();
+
+  // Once the ring is full, the newest line replaces the oldest.
+  size_t i = (_firstLogLine + _loggedLineCount) % _logLines.size();
+  if (_loggedLineCount < _logLines.size()) {
+    ++_loggedLineCount;
+  } else {
+    _firstLogLine = (_firstLogLine + 1) % _logLines.size();
+  }
+  _logLines[i].assign(line);
+  ++_totalLoggedLineCount;
+  _undrawnLogLineCount = min(_undrawnLogLineCount + 1, _logLines.size());
+}
+
+const string &GameBoard::logLine(size_t i) const {
+  return _logLines[(_firstLogLine + i) % _logLines.size()];
 }
 
 void GameBoard::handleInsertion() {
-  string str = _stringStream.str();
-  size_t strIndex = 0;
-  size_t newlineIndex = string::npos;
-  vector<string>lines;
+  // The lines are drawn by the next updateConsole, see drawLog.
+  string_view line;
+  while (_logBuffer.nextLine(line)) {
+    addLogLine(line);
+  }
+}
 
-  while ((newlineIndex = str.find('\n', strIndex)) != string::npos) {
-    lines.push_back(str.substr(strIndex, newlineIndex - strIndex));
-    strIndex = newlineIndex + 1;
+GameBoard::LogBuffer::LogBuffer() {
+  _bytes.resize(256);
+  setp(_bytes.data(), _bytes.data() + _bytes.size());
+}
+
+GameBoard::LogBuffer::int_type GameBoard::LogBuffer::overflow(int_type c) {
+  // Grows the buffer, keeping what's been inserted.
+  size_t count = pptr() - pbase();
+  _bytes.resize(_bytes.size() * 2);
+  setp(_bytes.data(), _bytes.data() + _bytes.size());
+  pbump(int(count));
+
+  if (!traits_type::eq_int_type(c, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(c);
+    pbump(1);
   }
-  log(lines);
+  return traits_type::not_eof(c);
+}
 
-  if (strIndex > 0) {
-    string remainder = str.substr(strIndex);
-    _stringStream.str(remainder);
-    _stringStream.rdbuf()->pubseekpos(remainder.length());
+bool GameBoard::LogBuffer::nextLine(string_view &line) {
+  char *lineStart = pbase() + _lineStart;
+  char *scanned = pbase() + _scannedCount;
+  char *newline = (char *)memchr(scanned, '\n', pptr() - scanned);
+  if (newline) {
+    line = string_view(lineStart, newline - lineStart);
+    _lineStart = _scannedCount = newline + 1 - pbase();
+    return true;
   }
+
+  // The remaining partial line is moved to the start of the buffer, where the
+  // rest of it will be inserted.
+  size_t partialCount = pptr() - lineStart;
+  memmove(pbase(), lineStart, partialCount);
+  setp(pbase(), epptr());
+  pbump(int(partialCount));
+  _lineStart = 0;
+  _scannedCount = partialCount;
+  return false;
 }
 
 GameBoard &GameBoard::operator<<(std::ostream &(*func)(std::ostream &)) {
-  func(_stringStream);
+  func(_logStream);
   handleInsertion();
   return *this;
 }
@@ -140,14 +380,30 @@ void GameBoard::rangeCheck(int row, int col) const {
   }
 }
 
-unsigned GameBoard::tileIndex(int row, int col) const {
+void GameBoard::rangeCheck(Rect rect) const {
+  if (rect.row < 0 || rect.col < 0 || rect.rowCount < 0 || rect.colCount < 0 ||
+      rect.row + rect.rowCount > _rowCount ||
+      rect.col + rect.colCount > _colCount) {
+    throw std::out_of_range("GameBoard:: illegal rect at row("s +
+                            to_string(rect.row) + ") col(" +
+                            to_string(rect.col) + ") with rowCount(" +
+                            to_string(rect.rowCount) + ") colCount(" +
+                            to_string(rect.colCount) + ")");
+  }
+}
+
+size_t GameBoard::tileIndex(int row, int col) const {
   rangeCheck(row, col);
-  return row * _colCount + col;
+  return size_t(row) * _colCount + col;
+}
+
+size_t GameBoard::viewportTileIndex(int viewportRow, int viewportCol) const {
+  return size_t(_viewportRow + viewportRow) * _colCount + _viewportCol +
+         viewportCol;
 }
 
 Tile GameBoard::tileAt(int row, int col) const {
-  unsigned i = tileIndex(row, col);
-  return Tile(_tiles[i], false);
+  return tileAtIndex(tileIndex(row, col));
 }
 
 Tile GameBoard::displayedTileAt(int row, int col) const {
@@ -155,10 +411,7 @@ Tile GameBoard::displayedTileAt(int row, int col) const {
 }
 
 void GameBoard::setTileAt(int row, int col, Tile tile) {
-  unsigned i = tileIndex(row, col);
-  if (_tiles[i] != tile) {
-    _tiles[i] = Tile(tile, true);
-  }
+  setTileAtIndex(tileIndex(row, col), row, col, tile);
 }
 
 void GameBoard::setTileAt(int row, int col, char glyph, Color color) {
@@ -174,21 +427,213 @@ void GameBoard::setGlyphAt(int row, int col, char glyph) {
 }
 
 void GameBoard::clearAllTiles() {
-  Tile blank = Tile();
-  for (int r = 0; r < _rowCount; ++r) {
-    for (int c = 0; c < _colCount; ++c) {
-      setTileAt(r, c, blank);
+  fillRect({0, 0, _rowCount, _colCount}, Tile());
+}
+
+void GameBoard::clearTileAt(int row, int col) { setTileAt(row, col, Tile()); }
+
+/* The bulk methods below check their bounds once, write the glyph & color
+planes directly, and mark the rows they touched as stale rather than dirtying
+tiles one by one. Stale rows are compared against the console by update().
+*/
+
+void GameBoard::fillRect(Rect rect, Tile tile) {
+  FrameTrace::Span span("fillRect");
+  rangeCheck(rect);
+  for (int r = rect.row; r < rect.row + rect.rowCount; ++r) {
+    size_t i = size_t(r) * _colCount + rect.col;
+    fill_n(&_glyphs[i], rect.colCount, tile._glyph);
+    fill_n(&_colors[i], rect.colCount, tile._color);
+  }
+  setRowsStale(rect.row, rect.rowCount);
+}
+
+void GameBoard::setRow(int row, std::span<const Tile> tiles) {
+  FrameTrace::Span span("setRow");
+  rangeCheck({row, 0, 1, int(tiles.size())});
+  size_t i = size_t(row) * _colCount;
+  for (const Tile &tile : tiles) {
+    _glyphs[i] = tile._glyph;
+    _colors[i] = tile._color;
+    ++i;
+  }
+  setRowsStale(row, 1);
+}
+
+void GameBoard::blit(const GameBoard &source, Rect sourceRect, int row,
+                     int col) {
+  FrameTrace::Span span("blit");
+  source.rangeCheck(sourceRect);
+  rangeCheck({row, col, sourceRect.rowCount, sourceRect.colCount});
+
+  // Blitting within a board may overlap, so copy rows in an order that
+  // doesn't overwrite rows before they're read (memmove handles the cols).
+  bool bottomUp = &source == this && row > sourceRect.row;
+  for (int i = 0; i < sourceRect.rowCount; ++i) {
+    int r = bottomUp ? sourceRect.rowCount - 1 - i : i;
+    size_t sourceIndex =
+        size_t(sourceRect.row + r) * source._colCount + sourceRect.col;
+    size_t index = size_t(row + r) * _colCount + col;
+    memmove(&_glyphs[index], &source._glyphs[sourceIndex],
+            sourceRect.colCount);
+    memmove(&_colors[index], &source._colors[sourceIndex],
+            sourceRect.colCount);
+  }
+  setRowsStale(row, sourceRect.rowCount);
+}
+
+void GameBoard::drawText(int row, int col, std::string_view text,
+                         Color color) {
+  FrameTrace::Span span("drawText");
+  rangeCheck({row, col, 1, int(text.size())});
+  size_t i = size_t(row) * _colCount + col;
+  copy(text.begin(), text.end(), &_glyphs[i]);
+  fill_n(&_colors[i], text.size(), color);
+  setRowsStale(row, 1);
+}
+
+/* Layers are composed into the board's own tiles, which are what's drawn.
+Changing a layer's tile recomposes just its position, looking down from the top
+layer for a tile that isn't empty, so a change beneath another tile stops
+there, and the position is dirtied only when the tile it shows changes.
+*/
+
+void GameBoard::setLayerCount(int count) {
+  if (count < 0) {
+    throw std::out_of_range("GameBoard:: illegal layer count:" +
+                            to_string(count));
+  }
+
+  size_t tileCount = size_t(_rowCount) * _colCount;
+  size_t previousCount = _layers.size();
+  _layers.resize(count);
+  for (size_t layer = previousCount; layer < _layers.size(); ++layer) {
+    _layers[layer].glyphs.assign(tileCount, '\0');
+    _layers[layer].colors.assign(tileCount, Color::defaultColor);
+  }
+
+  if (previousCount == 0 && count > 0) {
+    // The bottom layer starts out with the board's tiles, so adding layers
+    // doesn't change what's shown.
+    copy_n(_glyphs, tileCount, _layers[0].glyphs.begin());
+    copy_n(_colors, tileCount, _layers[0].colors.begin());
+  } else if (size_t(count) < previousCount && count > 0) {
+    // Tiles only covered by the removed layers show through.
+    for (int row = 0; row < _rowCount; ++row) {
+      for (int col = 0; col < _colCount; ++col) {
+        composeTile(size_t(row) * _colCount + col, row, col);
+      }
     }
   }
 }
 
-void GameBoard::clearTileAt(int row, int col) { setTileAt(row, col, Tile()); }
+void GameBoard::layerRangeCheck(int layer) const {
+  if (layer < 0 || layer >= int(_layers.size())) {
+    throw std::out_of_range("GameBoard:: illegal layer:" + to_string(layer));
+  }
+}
+
+void GameBoard::composeTile(size_t i, int row, int col) {
+  Tile tile;
+  for (size_t layer = _layers.size(); layer-- > 0;) {
+    if (_layers[layer].glyphs[i] != '\0') {
+      tile = Tile(_layers[layer].glyphs[i], _layers[layer].colors[i]);
+      break;
+    }
+  }
+  setTileAtIndex(i, row, col, tile);
+}
+
+Tile GameBoard::layerTileAt(int layer, int row, int col) const {
+  layerRangeCheck(layer);
+  size_t i = tileIndex(row, col);
+  return Tile(_layers[layer].glyphs[i], _layers[layer].colors[i]);
+}
+
+void GameBoard::setLayerTileAt(int layer, int row, int col, Tile tile) {
+  layerRangeCheck(layer);
+  size_t i = tileIndex(row, col);
+  TileLayer &tiles = _layers[layer];
+  if (tiles.glyphs[i] != tile._glyph || tiles.colors[i] != tile._color) {
+    tiles.glyphs[i] = tile._glyph;
+    tiles.colors[i] = tile._color;
+    composeTile(i, row, col);
+  }
+}
+
+void GameBoard::clearLayerTileAt(int layer, int row, int col) {
+  setLayerTileAt(layer, row, col, Tile());
+}
+
+// Moves a layer's tile, e.g. a sprite, leaving the layers beneath untouched.
+void GameBoard::moveLayerTile(int layer, int row, int col, int toRow,
+                              int toCol) {
+  rangeCheck(toRow, toCol);
+  Tile tile = layerTileAt(layer, row, col);
+  if (toRow != row || toCol != col) {
+    clearLayerTileAt(layer, row, col);
+    setLayerTileAt(layer, toRow, toCol, tile);
+  }
+}
+
+void GameBoard::fillLayerRect(int layer, Rect rect, Tile tile) {
+  FrameTrace::Span span("fillLayerRect");
+  layerRangeCheck(layer);
+  rangeCheck(rect);
+  TileLayer &tiles = _layers[layer];
+  for (int r = rect.row; r < rect.row + rect.rowCount; ++r) {
+    size_t i = size_t(r) * _colCount + rect.col;
+    fill_n(&tiles.glyphs[i], rect.colCount, tile._glyph);
+    fill_n(&tiles.colors[i], rect.colCount, tile._color);
+    for (int c = rect.col; c < rect.col + rect.colCount; ++c, ++i) {
+      composeTile(i, r, c);
+    }
+  }
+}
+
+void GameBoard::clearLayer(int layer) {
+  fillLayerRect(layer, {0, 0, _rowCount, _colCount}, Tile());
+}
+
+void GameBoard::setRowsStale(int row, int rowCount) {
+  int firstRow = max(row, _viewportRow) - _viewportRow;
+  int endRow = min(row + rowCount, _viewportRow + _viewportRowCount) -
+               _viewportRow;
+  for (int r = firstRow; r < endRow; ++r) {
+    _staleRowBits[r / 64] |= uint64_t(1) << (r % 64);
+  }
+}
+
+void GameBoard::setTileDirty(int row, int col) const {
+  /* Dirtiness is tracked per viewport position; changes outside the viewport
+  are ignored. A position is dirty when its bit in _dirtyBits is set. Each is
+  added to _dirtyTileIndexes only the first time it's dirtied, so drawing
+  costs O(changed tiles) rather than O(board area).
+  */
+  unsigned viewportRow = row - _viewportRow;
+  unsigned viewportCol = col - _viewportCol;
+  if (viewportRow < unsigned(_viewportRowCount) &&
+      viewportCol < unsigned(_viewportColCount)) {
+    setViewportTileDirty(viewportRow, viewportCol);
+  }
+}
+
+void GameBoard::setViewportTileDirty(int viewportRow, int viewportCol) const {
+  unsigned i = viewportRow * _viewportColCount + viewportCol;
+  uint64_t bit = uint64_t(1) << (i % 64);
+  if ((_dirtyBits[i / 64] & bit) == 0) {
+    _dirtyBits[i / 64] |= bit;
+    _dirtyTileIndexes.push_back(i);
+  }
+}
 
-void GameBoard::setDirtyOnAllTiles(bool dirty) const {
-  unsigned tileCount = _rowCount * _colCount;
-  for (unsigned i = 0; i < tileCount; ++i) {
-    _tiles[i] = Tile(_tiles[i], dirty);
+void GameBoard::clearDirtyTiles() const {
+  // Every set bit belongs to a listed tile, so zeroing the words they live in
+  // clears the bitmap without touching clean tiles.
+  for (unsigned i : _dirtyTileIndexes) {
+    _dirtyBits[i / 64] = 0;
   }
+  _dirtyTileIndexes.clear();
 }
 
 void GameBoard::setHighlightedCoords_(int row, int col) {
@@ -226,18 +671,18 @@ void GameBoard::setHighlightedCoords() {
   setHighlightedCoords_(kIllegalCoord, kIllegalCoord);
 };
 
-// Use vt100GraphicsStart/vt100GraphicsEnd to bracket printing to stdout draw
-// VT100 graphics characters.
+// Use vt100GraphicsStart/vt100GraphicsEnd to bracket appending to the frame to
+// draw VT100 graphics characters.
 
-void GameBoard::vt100GraphicsStart() const {
+void GameBoard::vt100GraphicsStart(string &frame) const {
   if (_vt100Mode) {
-    cout << "\x1B(0";
+    frame += "\x1B(0";
   }
 }
 
-void GameBoard::vt100GraphicsEnd() const {
+void GameBoard::vt100GraphicsEnd(string &frame) const {
   if (_vt100Mode) {
-    cout << "\x1B(B";
+    frame += "\x1B(B";
   }
 }
 
@@ -276,12 +721,79 @@ char GameBoard::verticalLineGlyph() const {
 }
 
 void GameBoard::updateConsole() const {
+  steady_clock::time_point start = steady_clock::now();
   if (_redrawNeeded || !_vt100Mode) {
+    FrameTrace::Span span("redraw");
     redraw();
     _redrawNeeded = false;
+    ++_encoding.stats.redrawCount;
+    _encoding.stats.redrawDuration += steady_clock::now() - start;
   } else {
+    FrameTrace::Span span("update");
     update();
+    ++_encoding.stats.updateCount;
+    _encoding.stats.updateDuration += steady_clock::now() - start;
+  }
+  flushFrame();
+}
+
+void GameBoard::setRenderSink(RenderSink *renderSink) {
+  static StdoutSink stdoutSink;
+  _renderSink = renderSink ? renderSink : &stdoutSink;
+
+  // A different sink hasn't seen any of the previous frames.
+  _redrawNeeded = true;
+}
+
+void GameBoard::setEncodingThreadCount(int threadCount) {
+  if (threadCount < 0) {
+    throw std::out_of_range("GameBoard:: illegal encoding thread count:" +
+                            to_string(threadCount));
+  }
+  _encodingThreadCount = threadCount;
+}
+
+void GameBoard::flushFrame() const {
+  {
+    FrameTrace::Span span("write");
+    _renderSink->write(_encoding.frame);
   }
+
+  _encoding.stats.frameCount = 1;
+  _encoding.stats.byteCount = _encoding.frame.size();
+  _lastFrameStats = _encoding.stats;
+  _totalFrameStats += _encoding.stats;
+  _encoding.stats = FrameStats();
+
+  // clear() keeps the capacity, so steady-state frames don't allocate.
+  _encoding.frame.clear();
+
+  // Between frames the caller may print anything, so the cursor position and
+  // attributes tracked while composing the frame are no longer known.
+  _encoding.cursorRow = kIllegalCoord;
+  _encoding.cursorCol = kIllegalCoord;
+  _encoding.attributes = kUnknownAttributes;
+}
+
+void GameBoard::resetFrameStats() {
+  _lastFrameStats = FrameStats();
+  _totalFrameStats = FrameStats();
+}
+
+GameBoard::FrameStats &
+GameBoard::FrameStats::operator+=(const FrameStats &stats) {
+  frameCount += stats.frameCount;
+  redrawCount += stats.redrawCount;
+  updateCount += stats.updateCount;
+  tileCount += stats.tileCount;
+  cursorMoveCount += stats.cursorMoveCount;
+  attributeChangeCount += stats.attributeChangeCount;
+  byteCount += stats.byteCount;
+  redrawDuration += stats.redrawDuration;
+  updateDuration += stats.updateDuration;
+  logDuration += stats.logDuration;
+  messageDuration += stats.messageDuration;
+  return *this;
 }
 
 void GameBoard::redrawConsole() const {
@@ -289,537 +801,2705 @@ void GameBoard::redrawConsole() const {
   updateConsole();
 }
 
+// Coords are displayed in two digits, so larger boards show them modulo 100.
+static int coordLabel(int coord) { return coord % 100; }
+
 void GameBoard::drawTop(bool showCoords) const {
   const char *indent = showCoords ? "  " : "";
+  int viewportColEnd = _viewportCol + _viewportColCount;
 
   if (showCoords) {
-    cout << indent << ' ';
-    for (int c = 0; c < _colCount; ++c) {
-      bool highlight = _vt100Mode && c == _highlightedCol;
-      if (highlight) {
-        Tile::colorStart(_highlightedCoordsColor);
-      }
+    _encoding.frame += indent;
+    _encoding.frame += ' ';
+    for (int col = _viewportCol; col < viewportColEnd; ++col) {
+      int c = coordLabel(_coordOriginCol + col);
+      bool highlight = _vt100Mode && col == _highlightedCol;
+      setAttributes(_encoding, highlight ? _highlightedCoordsColor
+                                         : Color::defaultColor);
 
       if (c > 9) {
-        cout << c / 10 << ' ';
+        appendNumber(_encoding.frame, c / 10);
+        _encoding.frame += ' ';
       } else {
-        cout << "  ";
-      }
-
-      if (highlight) {
-        Tile::colorEnd(_highlightedCoordsColor);
+        _encoding.frame += "  ";
       }
     }
-    cout << endl;
-
-    cout << indent << ' ';
-    for (int c = 0; c < _colCount; ++c) {
-      bool highlight = _vt100Mode && c == _highlightedCol;
-      if (highlight) {
-        Tile::colorStart(_highlightedCoordsColor);
-      }
-
-      cout << c % 10 << ' ';
-
-      if (highlight) {
-        Tile::colorEnd(_highlightedCoordsColor);
-      }
+    _encoding.frame += '\n';
+
+    _encoding.frame += indent;
+    _encoding.frame += ' ';
+    for (int col = _viewportCol; col < viewportColEnd; ++col) {
+      int c = coordLabel(_coordOriginCol + col);
+      bool highlight = _vt100Mode && col == _highlightedCol;
+      setAttributes(_encoding, highlight ? _highlightedCoordsColor
+                                         : Color::defaultColor);
+
+      appendNumber(_encoding.frame, c % 10);
+      _encoding.frame += ' ';
     }
-    cout << endl;
+    _encoding.frame += '\n';
   }
 
-  vt100GraphicsStart();
-  cout << indent;
-  cout << topLeftCornerGlyph();
+  setAttributes(_encoding, Color::defaultColor);
+  vt100GraphicsStart(_encoding.frame);
+  _encoding.frame += indent;
+  _encoding.frame += topLeftCornerGlyph();
   char line = horizontalLineGlyph();
-  int drawCount = 2 * _colCount - 1;
+  int drawCount = 2 * _viewportColCount - 1;
   for (int c = 0; c < drawCount; c++) {
-    cout << line;
+    _encoding.frame += line;
   }
-  cout << topRightCornerGlyph();
-  vt100GraphicsEnd();
-  cout << endl;
+  _encoding.frame += topRightCornerGlyph();
+  vt100GraphicsEnd(_encoding.frame);
+  _encoding.frame += '\n';
 }
 
 void GameBoard::drawBottom(bool showCoords) const {
   const char *indent = showCoords ? "  " : "";
+  int viewportColEnd = _viewportCol + _viewportColCount;
 
-  vt100GraphicsStart();
-  cout << indent;
-  cout << bottomLeftCornerGlyph();
+  setAttributes(_encoding, Color::defaultColor);
+  vt100GraphicsStart(_encoding.frame);
+  _encoding.frame += indent;
+  _encoding.frame += bottomLeftCornerGlyph();
   char line = horizontalLineGlyph();
-  int drawCount = 2 * _colCount - 1;
+  int drawCount = 2 * _viewportColCount - 1;
   for (int c = 0; c < drawCount; c++) {
-    cout << line;
+    _encoding.frame += line;
   }
-  cout << bottomRightCornerGlyph();
-  vt100GraphicsEnd();
-  cout << endl;
+  _encoding.frame += bottomRightCornerGlyph();
+  vt100GraphicsEnd(_encoding.frame);
+  _encoding.frame += '\n';
 
   if (showCoords) {
-    cout << indent << ' ';
-    for (int c = 0; c < _colCount; ++c) {
-      bool highlight = _vt100Mode && c == _highlightedCol;
-      if (highlight) {
-        Tile::colorStart(_highlightedCoordsColor);
-      }
-
-      cout << ((c < 10) ? c : c / 10) << ' ';
-
-      if (highlight) {
-        Tile::colorEnd(_highlightedCoordsColor);
-      }
+    _encoding.frame += indent;
+    _encoding.frame += ' ';
+    for (int col = _viewportCol; col < viewportColEnd; ++col) {
+      int c = coordLabel(_coordOriginCol + col);
+      bool highlight = _vt100Mode && col == _highlightedCol;
+      setAttributes(_encoding, highlight ? _highlightedCoordsColor
+                                         : Color::defaultColor);
+
+      appendNumber(_encoding.frame, (c < 10) ? c : c / 10);
+      _encoding.frame += ' ';
     }
-    cout << endl;
+    _encoding.frame += '\n';
 
-    cout << indent << ' ';
-    for (int c = 0; c < _colCount; ++c) {
+    _encoding.frame += indent;
+    _encoding.frame += ' ';
+    for (int col = _viewportCol; col < viewportColEnd; ++col) {
+      int c = coordLabel(_coordOriginCol + col);
       if (c < 10) {
-        cout << "  ";
+        _encoding.frame += "  ";
       } else {
-        bool highlight = _vt100Mode && c == _highlightedCol;
-        if (highlight) {
-          Tile::colorStart(_highlightedCoordsColor);
-        }
-
-        cout << c % 10 << ' ';
+        bool highlight = _vt100Mode && col == _highlightedCol;
+        setAttributes(_encoding, highlight ? _highlightedCoordsColor
+                                           : Color::defaultColor);
 
-        if (highlight) {
-          Tile::colorEnd(_highlightedCoordsColor);
-        }
+        appendNumber(_encoding.frame, c % 10);
+        _encoding.frame += ' ';
       }
     }
-    cout << endl;
+    _encoding.frame += '\n';
   }
 }
 
-void GameBoard::drawRow(int row, bool showCoords) const {
+void GameBoard::drawRow(FrameEncoding &e, int row, bool showCoords) const {
   if (showCoords) {
     bool highlight = _vt100Mode && row == _highlightedRow;
-    if (highlight) {
-      Tile::colorStart(_highlightedCoordsColor);
-    }
+    setAttributes(e, highlight ? _highlightedCoordsColor
+                               : Color::defaultColor);
 
-    printf("%2d", row);
+    appendNumber(e.frame, coordLabel(_coordOriginRow + row), 2);
+  }
 
-    if (highlight) {
-      Tile::colorEnd(_highlightedCoordsColor);
+  // Escape mode interprets chars as special vt100 graphic glyphs.
+  setAttributes(e, Color::defaultColor);
+  vt100GraphicsStart(e.frame);
+  e.frame += verticalLineGlyph();
+  vt100GraphicsEnd(e.frame);
+
+  for (int c = 0; c < _viewportColCount; c++) {
+    if (c > 0) {
+      e.frame += ' '; // a space between cols makes the board appear more "square."
     }
+    drawTile(e, displayedTileAt(row, _viewportCol + c));
   }
 
-  // Escape mode interprets chars as special vt100 graphic glyphs.
-  vt100GraphicsStart();
-  cout << verticalLineGlyph();
-  vt100GraphicsEnd();
+  e.stats.tileCount += _viewportColCount;
 
-  displayedTileAt(row, 0).draw(_displayEmptyTileDots);
-  for (int c = 1; c < _colCount; c++) {
-    cout << ' '; // a space between cols makes the board appear more "square."
-    Tile tile = displayedTileAt(row, c);
-    tile.draw(_displayEmptyTileDots);
-  }
+  size_t i = tileIndex(row, _viewportCol);
+  size_t consoleIndex = (row - _viewportRow) * _viewportColCount;
+  copy_n(&_glyphs[i], _viewportColCount, &_consoleGlyphs[consoleIndex]);
+  copy_n(&_colors[i], _viewportColCount, &_consoleColors[consoleIndex]);
 
   // Escape mode interprets chars as special vt100 graphic glyphs.
-  vt100GraphicsStart();
-  cout << verticalLineGlyph();
-  vt100GraphicsEnd();
+  setAttributes(e, Color::defaultColor);
+  vt100GraphicsStart(e.frame);
+  e.frame += verticalLineGlyph();
+  vt100GraphicsEnd(e.frame);
 
   if (showCoords) {
     bool highlight = _vt100Mode && row == _highlightedRow;
-    if (highlight) {
-      Tile::colorStart(_highlightedCoordsColor);
-    }
+    setAttributes(e, highlight ? _highlightedCoordsColor
+                               : Color::defaultColor);
 
-    printf("%-2d", row);
-
-    if (highlight) {
-      Tile::colorEnd(_highlightedCoordsColor);
-    }
+    appendNumber(e.frame, coordLabel(_coordOriginRow + row), 2, true);
   }
 
-  cout << endl;
+  e.frame += '\n';
 }
 
 void GameBoard::clearScreen() const {
   if (_vt100Mode) {
     // Clear screens (\x1B[2J) _and_ positions cursor at 0,0 (\x1B[0;0H).
-    cout << "\x1B[2J\x1B[0;0H";
+    _encoding.frame += "\x1B[2J\x1B[0;0H";
   }
 }
 
-void GameBoard::redraw() const {
-  clearScreen();
-
-  drawTop(_displayCoords);
-
-  for (int r = 0; r < _rowCount; r++) {
-    drawRow(r, _displayCoords);
+int GameBoard::cursorMoveCost(const FrameEncoding &e, int vt100Row,
+                              int vt100Col) const {
+  /* Returns the fewest bytes that move the cursor from where e's bytes leave
+  it to vt100Row, vt100Col. The options are an absolute CUP, or a
+  vertical CUU/CUD combined with a horizontal CUF/CUB or a carriage return.
+  */
+  if (vt100Row == e.cursorRow && vt100Col == e.cursorCol) {
+    return 0;
   }
 
-  drawBottom(_displayCoords);
+  // \x1B[{row};{col}H, where a col of one can be left out.
+  int absoluteCost = 3 + numberLength(vt100Row) +
+                     ((vt100Col > 1) ? 1 + numberLength(vt100Col) : 0);
+  if (e.cursorRow == kIllegalCoord) {
+    return absoluteCost;
+  }
 
-  drawMessage();
-  drawLog();
+  int rowDelta = abs(vt100Row - e.cursorRow);
+  int colDelta = abs(vt100Col - e.cursorCol);
+  int verticalCost = rowDelta ? relativeMoveCost(rowDelta) : 0;
+  int horizontalCost = colDelta ? relativeMoveCost(colDelta) : 0;
+  int returnCost = 1 + ((vt100Col > 1) ? relativeMoveCost(vt100Col - 1) : 0);
 
-  setDirtyOnAllTiles(false);
-  _dirtyHighlightedRow = kIllegalCoord;
-  _dirtyHighlightedCol = kIllegalCoord;
+  return min(absoluteCost, verticalCost + min(horizontalCost, returnCost));
 }
 
-void GameBoard::update() const {
-  cout << "\x1B"
-          "7"; // save cursor & attrs
-
-  int vt100CoordOffset = _displayCoords ? 2 : 0;
-
-  unsigned tileIndex = 0;
-  for (int r = 0; r < _rowCount; ++r) {
-    for (int c = 0; c < _colCount; ++c) {
-      Tile tile(_tiles[tileIndex]);
-      if (tile.isDirty()) {
-        // vt100 numbers rows/cols starting with one.
-        int vt100Row = r + 2 + vt100CoordOffset;
-        int vt100Col = 2 * c + 2 + vt100CoordOffset;
-        printf("\x1B[%d;%dH", vt100Row, vt100Col); // position cursor
+void GameBoard::moveCursor(FrameEncoding &e, int vt100Row, int vt100Col) const {
+  // Emits whichever of the moves priced by cursorMoveCost is cheapest.
+  int cost = cursorMoveCost(e, vt100Row, vt100Col);
+  if (cost == 0) {
+    return;
+  }
 
-        tile.draw(_displayEmptyTileDots);
+  int absoluteCost = 3 + numberLength(vt100Row) +
+                     ((vt100Col > 1) ? 1 + numberLength(vt100Col) : 0);
+  if (e.cursorRow == kIllegalCoord || cost == absoluteCost) {
+    e.frame += "\x1B[";
+    appendNumber(e.frame, vt100Row);
+    if (vt100Col > 1) {
+      e.frame += ';';
+      appendNumber(e.frame, vt100Col);
+    }
+    e.frame += 'H';
+  } else {
+    int rowDelta = vt100Row - e.cursorRow;
+    if (rowDelta != 0) {
+      appendRelativeMove(e.frame, abs(rowDelta), rowDelta < 0 ? 'A' : 'B');
+    }
 
-        _tiles[tileIndex] = Tile(tile, false);
+    int colDelta = vt100Col - e.cursorCol;
+    int horizontalCost = colDelta ? relativeMoveCost(abs(colDelta)) : 0;
+    int returnCost = 1 + ((vt100Col > 1) ? relativeMoveCost(vt100Col - 1) : 0);
+    if (returnCost < horizontalCost) {
+      e.frame += '\r';
+      if (vt100Col > 1) {
+        appendRelativeMove(e.frame, vt100Col - 1, 'C');
       }
-      ++tileIndex;
+    } else if (colDelta != 0) {
+      appendRelativeMove(e.frame, abs(colDelta), colDelta < 0 ? 'D' : 'C');
     }
   }
 
-  if (_displayCoords) {
-    updateHighlightedCoords();
-  }
-
-  cout << "\x1B"
-          "8"; // restore cursor & attrs
+  e.cursorRow = vt100Row;
+  e.cursorCol = vt100Col;
+  ++e.stats.cursorMoveCount;
 }
 
-int GameBoard::firstLogLineVT100Row() const {
-  return firstMessageLineVT100Row() + _messageLines.size();
-}
+static const struct {
+  bool dim;
+  unsigned char foreground;
+} kVT100AttributeCodes[] = {
+    {false, 39}, // default
+    {false, 30}, // black
+    {false, 31}, // red
+    {false, 32}, // green
+    {false, 33}, // yellow
+    {false, 34}, // blue
+    {false, 35}, // magenta
+    {false, 36}, // cyan
+    {false, 37}, // white
+    {true, 31},  // dark red
+    {true, 34},  // dark blue
+    {true, 37},  // dark white
+    {true, 39},  // dim, for empty tile dots
+};
 
-int GameBoard::firstMessageLineVT100Row() const {
-  return _rowCount + 3 + (_displayCoords ? 4 : 0);
+// The Color displayed, when not dim, by a foreground code.
+static Color foregroundColor(unsigned foreground) {
+  return (foreground >= 30 && foreground <= 37)
+             ? Color(Color::black + (foreground - 30))
+             : Color::defaultColor;
 }
 
-void GameBoard::drawMessage() const {
-  cout << "\x1B"
-          "7"; // save cursor & attrs
+void GameBoard::setAttributes(FrameEncoding &e,
+                              unsigned char attributes) const {
+  /* Display attribute syntax: <ESC>[{attr1};...;{attrn}m
+
+  Emits only what it takes to go from the attributes the frame has left the
+  terminal in, e.attributes, to the requested ones: nothing when they match,
+  and just the new foreground when only the color changes. Turning dim off, or
+  starting from unknown attributes, requires a reset (0) first.
+  */
+  if (attributes == e.attributes) {
+    return;
+  }
 
-  int firstRow = firstMessageLineVT100Row();
-  size_t messageCount = _messageLines.size();
-  for (int i = 0; i < messageCount; ++i) {
-    printf("\x1B[%u;%uH\x1B[2K", firstRow + i,
-           0); // position cursor & erase line
-    cout << _messageLines[i] << endl;
+  string &frame = e.frame;
+  auto codes = kVT100AttributeCodes[attributes];
+  frame += "\x1B[";
+  if (e.attributes == kUnknownAttributes || attributes == Color::defaultColor ||
+      (kVT100AttributeCodes[e.attributes].dim && !codes.dim)) {
+    frame += '0';
+    if (codes.dim) {
+      frame += ";2";
+    }
+    if (codes.foreground != 39) {
+      frame += ';';
+      appendNumber(frame, codes.foreground);
+    }
+  } else {
+    auto previousCodes = kVT100AttributeCodes[e.attributes];
+    if (codes.dim && !previousCodes.dim) {
+      frame += '2';
+      if (codes.foreground != previousCodes.foreground) {
+        frame += ';';
+      }
+    }
+    if (codes.foreground != previousCodes.foreground) {
+      appendNumber(frame, codes.foreground);
+    }
   }
+  frame += 'm';
 
-  cout << "\x1B"
-          "8"; // restore cursor & attrs
+  e.attributes = attributes;
+  ++e.stats.attributeChangeCount;
 }
 
-void GameBoard::drawLog() const {
-  int firstRow = firstLogLineVT100Row();
-  size_t logCount = _logLines.size();
-  for (int i = 0; i < logCount; ++i) {
-    printf("\x1B[%u;%uH\x1B[2K", firstRow + i,
-           0); // position cursor & erase line
-    cout << _logLines[i] << endl;
+// Draws a tile at the current cursor.
+void GameBoard::drawTile(FrameEncoding &e, Tile tile) const {
+  if (tile._glyph != '\0') {
+    setAttributes(e, tile._color);
+    e.frame += tile._glyph;
+  } else if (_displayEmptyTileDots) {
+    setAttributes(e, kDimAttributes);
+    e.frame += "•";
+  } else {
+    e.frame += ' '; // a space looks the same in any attributes
   }
 }
 
-void GameBoard::clearLog() {
-  int firstRow = firstLogLineVT100Row();
-  for (int i = 0; i < _logLineCount; ++i) {
-    printf("\x1B[%u;%uH\x1B[2K", firstRow + i,
-           0); // position cursor & erase line
-  }
-  _logLines.clear();
-}
+bool GameBoard::screenMatches(const HeadlessTerminal &terminal) const {
+  int vt100CoordOffset = _displayCoords ? 2 : 0;
 
-void GameBoard::setLogLineCount(int count) {
-  // Intended to be called _before_ the board is first drawn.
-  // No attempt is made to update existing log lines in the console.
-  while (_logLines.size() > count) {
-    _logLines.erase(_logLines.begin());
+  for (int r = 0; r < _viewportRowCount; ++r) {
+    for (int c = 0; c < _viewportColCount; ++c) {
+      // Zero based, unlike the vt100 rows & cols in update.
+      int row = r + 1 + vt100CoordOffset;
+      int col = 2 * c + 1 + vt100CoordOffset;
+      if (row >= terminal.rowCount() || col >= terminal.colCount()) {
+        return false;
+      }
+
+      Tile tile = displayedTileAt(_viewportRow + r, _viewportCol + c);
+      HeadlessTerminal::Cell expected;
+      unsigned char attributes = tile._color;
+      if (tile._glyph != '\0') {
+        expected.glyph = (unsigned char)tile._glyph;
+      } else if (_displayEmptyTileDots) {
+        expected.glyph = U'•';
+        attributes = kDimAttributes;
+      }
+      expected.dim = kVT100AttributeCodes[attributes].dim;
+      expected.color =
+          foregroundColor(kVT100AttributeCodes[attributes].foreground);
+
+      const HeadlessTerminal::Cell &cell = terminal.cellAt(row, col);
+      if (expected.glyph == U' ' ? cell.glyph != U' ' : cell != expected) {
+        return false; // a space looks the same in any attributes
+      }
+    }
   }
-  _logLineCount = count;
-}
 
-void GameBoard::updateRowCoords(int row) const {
-  int vt100Row = row + 4;
-  int vt100ColLeft = 1;
-  int vt100ColRight = _colCount * 2 + 4;
-  printf("\x1B[%d;%dH%2d", vt100Row, vt100ColLeft, row);
-  printf("\x1B[%d;%dH%-2d", vt100Row, vt100ColRight, row);
+  return true;
 }
 
-void GameBoard::updateColCoords(int col) const {
-  int vt100Row0 = 1;
-  int vt100Row1 = 2;
-  int vt100Row3 = _rowCount + 5;
-  int vt100Row4 = _rowCount + 6;
-  int vt100Col = col * 2 + 4;
+void GameBoard::redraw() const {
+  clearScreen();
 
-  if (col > 9) {
-    printf("\x1B[%d;%dH%-2d", vt100Row0, vt100Col, col / 10);
-    printf("\x1B[%d;%dH%-2d", vt100Row4, vt100Col, col % 10);
-  }
+  drawTop(_displayCoords);
+
+  // Each band is a run of rows, which leave the terminal in the attributes of
+  // their right coords, or else of their border. A board without rows is
+  // still one (empty) band.
+  size_t bandCount = encodingBandCount(size_t(_viewportRowCount) *
+                                       _viewportColCount);
+  bandCount = max(min(bandCount, size_t(_viewportRowCount)), size_t(1));
+  int bandRowCount = (_viewportRowCount + bandCount - 1) / bandCount;
+  encodeBands(
+      bandCount,
+      [&](FrameEncoding &e, size_t band) {
+        int row = _viewportRow + band * bandRowCount - 1;
+        bool highlight = _displayCoords && _vt100Mode && row == _highlightedRow;
+        e.attributes =
+            highlight ? _highlightedCoordsColor : Color::defaultColor;
+      },
+      [&](FrameEncoding &e, size_t band) {
+        int firstRow = band * bandRowCount;
+        int endRow = min(firstRow + bandRowCount, _viewportRowCount);
+        for (int r = firstRow; r < endRow; r++) {
+          drawRow(e, _viewportRow + r, _displayCoords);
+        }
+      });
+
+  drawBottom(_displayCoords);
+  setAttributes(_encoding, Color::defaultColor);
 
-  printf("\x1B[%d;%dH%-2d", vt100Row1, vt100Col, col % 10);
-  printf("\x1B[%d;%dH%-2d", vt100Row3, vt100Col, (col > 9) ? col / 10 : col);
+  drawMessage();
+
+  // The screen's been cleared, so every line is drawn.
+  _drawnLogLineCount = 0;
+  _undrawnLogLineCount = _loggedLineCount;
+  _logCleared = false;
+  drawLog();
+
+  clearDirtyTiles();
+  fill(_staleRowBits.begin(), _staleRowBits.end(), 0);
+  _viewportMoved = false;
+  _dirtyHighlightedRow = kIllegalCoord;
+  _dirtyHighlightedCol = kIllegalCoord;
 }
 
-void GameBoard::updateHighlightedCoords() const {
-  if (_highlightedRow != kIllegalCoord || _highlightedCol != kIllegalCoord) {
-    Tile::colorStart(_highlightedCoordsColor);
-    updateRowCoords(_highlightedRow);
-    updateColCoords(_highlightedCol);
-    Tile::colorEnd(_highlightedCoordsColor);
+void GameBoard::collectDirtyTiles() const {
+  FrameTrace::Span span("collectDirty");
+
+  // In rows changed in bulk, or after the viewport moves, only the positions
+  // now showing a different tile need to be redrawn.
+  for (size_t word = 0; word < _staleRowBits.size(); ++word) {
+    for (uint64_t bits = _staleRowBits[word]; bits != 0; bits &= bits - 1) {
+      int r = word * 64 + __builtin_ctzll(bits);
+      size_t i = viewportTileIndex(r, 0);
+      size_t consoleIndex = r * _viewportColCount;
+      diffTiles(&_glyphs[i], &_colors[i], &_consoleGlyphs[consoleIndex],
+                &_consoleColors[consoleIndex], _viewportColCount,
+                [&](int c) { setViewportTileDirty(r, c); });
+    }
+    _staleRowBits[word] = 0;
   }
 
-  if (_dirtyHighlightedRow != kIllegalCoord) {
-    Tile::colorStart(Color::defaultColor);
-    updateRowCoords(_dirtyHighlightedRow);
-    Tile::colorEnd(Color::defaultColor);
-    _dirtyHighlightedRow = kIllegalCoord;
-  }
+  // Sorting the (short) dirty list puts it in row-major order, the order the
+  // tiles are drawn in.
+  sort(_dirtyTileIndexes.begin(), _dirtyTileIndexes.end());
+}
+
+// Threads shared by every board for composing the bands of large frames. The
+// thread calling run composes bands as well, so with N threads in the pool,
+// N + 1 bands are composed at once.
+class EncodingPool {
+public:
+  EncodingPool() {
+    unsigned threadCount = max(thread::hardware_concurrency(), 1u) - 1;
+    for (unsigned i = 0; i < threadCount; ++i) {
+      _threads.emplace_back([this] { work(); });
+    }
+  }
+
+  ~EncodingPool() {
+    {
+      lock_guard<mutex> lock(_mutex);
+      _stopping = true;
+    }
+    _workReady.notify_all();
+    for (thread &t : _threads) {
+      t.join();
+    }
+  }
+
+  size_t threadCount() const { return _threads.size(); }
+
+  // Runs task(0) through task(taskCount - 1), returning once they're all done.
+  // Boards drawn on different threads take turns.
+  void run(size_t taskCount, const function<void(size_t)> &task) {
+    lock_guard<mutex> runLock(_runMutex);
+    {
+      lock_guard<mutex> lock(_mutex);
+      _task = &task;
+      _taskCount = taskCount;
+      _nextTask = 0;
+      _finishedTaskCount = 0;
+      ++_generation;
+    }
+    _workReady.notify_all();
+
+    size_t finishedCount = runTasks(task, taskCount);
+
+    // The task mustn't go away while any thread is still running it.
+    unique_lock<mutex> lock(_mutex);
+    _finishedTaskCount += finishedCount;
+    _workDone.wait(lock, [&] {
+      return _finishedTaskCount == _taskCount && _busyThreadCount == 0;
+    });
+    _task = nullptr;
+    _taskCount = 0;
+  }
+
+private:
+  vector<thread> _threads;
+  mutex _runMutex;
+  mutex _mutex;
+  condition_variable _workReady;
+  condition_variable _workDone;
+  const function<void(size_t)> *_task = nullptr;
+  size_t _taskCount = 0;
+  atomic<size_t> _nextTask{0};
+  size_t _finishedTaskCount = 0;
+  unsigned _busyThreadCount = 0;
+  uint64_t _generation = 0;
+  bool _stopping = false;
+
+  size_t runTasks(const function<void(size_t)> &task, size_t taskCount) {
+    size_t finishedCount = 0;
+    for (size_t i = _nextTask++; i < taskCount; i = _nextTask++) {
+      task(i);
+      ++finishedCount;
+    }
+    return finishedCount;
+  }
+
+  void work() {
+    uint64_t generation = 0;
+    unique_lock<mutex> lock(_mutex);
+    while (true) {
+      _workReady.wait(lock,
+                      [&] { return _stopping || _generation != generation; });
+      if (_stopping) {
+        return;
+      }
+      generation = _generation;
+      if (_task == nullptr) {
+        continue; // woken after the run was over
+      }
+
+      const function<void(size_t)> &task = *_task;
+      size_t taskCount = _taskCount;
+      ++_busyThreadCount;
+      lock.unlock();
+      size_t finishedCount = runTasks(task, taskCount);
+      lock.lock();
+      --_busyThreadCount;
+      _finishedTaskCount += finishedCount;
+      _workDone.notify_one();
+    }
+  }
+};
+
+// Started on first use, by the first frame big enough to be split.
+static EncodingPool &encodingPool() {
+  static EncodingPool pool;
+  return pool;
+}
+
+size_t GameBoard::encodingBandCount(size_t tileCount) const {
+  size_t threadCount = _encodingThreadCount > 0
+                           ? _encodingThreadCount
+                           : max(thread::hardware_concurrency(), 1u);
+  return clamp(tileCount / kMinEncodingBandTileCount, size_t(1), threadCount);
+}
+
+void GameBoard::encodeBands(
+    size_t bandCount,
+    const function<void(FrameEncoding &, size_t)> &predictStart,
+    const function<void(FrameEncoding &, size_t)> &encode) const {
+  /* Composes a frame's bands in order, encode(e, band) appending one to e,
+  each on its own thread when there's more than one. The bytes of a band
+  depend on the cursor & attributes the bands before it leave, so each but the
+  first starts from those predictStart expects. Joining the bands, any whose
+  prediction turns out wrong is composed again, after the ones before it, so
+  the frame is byte for byte the serial one.
+  */
+  if (bandCount <= 1) {
+    encode(_encoding, 0);
+    return;
+  }
+
+  struct BandStart {
+    int cursorRow;
+    int cursorCol;
+    unsigned char attributes;
+  };
+  vector<BandStart> bandStarts(bandCount);
+  _bandEncodings.resize(bandCount - 1);
+  for (size_t band = 1; band < bandCount; ++band) {
+    FrameEncoding &e = _bandEncodings[band - 1];
+    e.frame.clear();
+    e.cursorRow = _encoding.cursorRow;
+    e.cursorCol = _encoding.cursorCol;
+    e.attributes = _encoding.attributes;
+    e.stats = FrameStats();
+    predictStart(e, band);
+    bandStarts[band] = {e.cursorRow, e.cursorCol, e.attributes};
+  }
+
+  // The first band goes straight into the frame.
+  encodingPool().run(bandCount, [&](size_t band) {
+    FrameTrace::Span span("encodeBand");
+    encode(band == 0 ? _encoding : _bandEncodings[band - 1], band);
+  });
+
+  for (size_t band = 1; band < bandCount; ++band) {
+    const BandStart &start = bandStarts[band];
+    if (_encoding.cursorRow != start.cursorRow ||
+        _encoding.cursorCol != start.cursorCol ||
+        _encoding.attributes != start.attributes) {
+      encode(_encoding, band);
+      continue;
+    }
+
+    FrameEncoding &e = _bandEncodings[band - 1];
+    _encoding.frame += e.frame;
+    _encoding.cursorRow = e.cursorRow;
+    _encoding.cursorCol = e.cursorCol;
+    _encoding.attributes = e.attributes;
+    _encoding.stats += e.stats;
+  }
+}
+
+void GameBoard::encodeDirtyTiles(FrameEncoding &e, size_t first,
+                                 size_t last) const {
+  /* Draws the tiles listed in _dirtyTileIndexes from first up to last, that
+  differ from the console's, left to right in each row. The console tiles are
+  only read, so bands can be drawn at once, and are updated by the caller.
+  */
+  int vt100CoordOffset = _displayCoords ? 2 : 0;
+  int previousRow = kIllegalCoord;
+  int previousCol = kIllegalCoord;
+
+  for (size_t d = first; d < last; ++d) {
+    unsigned consoleIndex = _dirtyTileIndexes[d];
+    int r = consoleIndex / _viewportColCount;
+    int c = consoleIndex % _viewportColCount;
+    size_t i = viewportTileIndex(r, c);
+    if (_glyphs[i] == _consoleGlyphs[consoleIndex] &&
+        _colors[i] == _consoleColors[consoleIndex]) {
+      continue; // e.g. changed, then changed back
+    }
+
+    // vt100 numbers rows/cols starting with one.
+    int vt100Row = r + 2 + vt100CoordOffset;
+    int vt100Col = 2 * c + 2 + vt100CoordOffset;
+
+    // When the previous dirty tile is close by, re-emitting the clean tiles in
+    // between can be cheaper than moving over them. Each tile costs at least
+    // two bytes with its separator, so beyond one tile in between a cursor
+    // move always wins. When it doesn't win, the gap is taken back out.
+    if (r == previousRow && c - previousCol <= 2) {
+      size_t gapStart = e.frame.size();
+      unsigned char attributes = e.attributes;
+      uint64_t attributeChangeCount = e.stats.attributeChangeCount;
+      for (int gapCol = previousCol + 1; gapCol < c; ++gapCol) {
+        size_t gapIndex = consoleIndex - c + gapCol;
+        e.frame += ' ';
+        drawTile(e, Tile(_consoleGlyphs[gapIndex], _consoleColors[gapIndex]));
+      }
+      e.frame += ' ';
+
+      if (int(e.frame.size() - gapStart) <
+          cursorMoveCost(e, vt100Row, vt100Col)) {
+        e.cursorCol = vt100Col;
+      } else {
+        e.frame.resize(gapStart);
+        e.attributes = attributes;
+        e.stats.attributeChangeCount = attributeChangeCount;
+      }
+    }
+    moveCursor(e, vt100Row, vt100Col);
+
+    drawTile(e, Tile(_glyphs[i], _colors[i]));
+    ++e.stats.tileCount;
+    ++e.cursorCol;
+    previousRow = r;
+    previousCol = c;
+  }
+}
+
+void GameBoard::update() const {
+  _encoding.frame += "\x1B"
+                     "7"; // save cursor & attrs
+
+  collectDirtyTiles();
+
+  // Each band is a run of whole rows' dirty tiles, since the tiles drawn in a
+  // row depend on each other, see encodeDirtyTiles.
+  size_t dirtyCount = _dirtyTileIndexes.size();
+  size_t bandCount = encodingBandCount(dirtyCount);
+  auto bandStart = [&](size_t band) {
+    size_t d = dirtyCount * band / bandCount;
+    while (d > 0 && d < dirtyCount &&
+           _dirtyTileIndexes[d] / _viewportColCount ==
+               _dirtyTileIndexes[d - 1] / _viewportColCount) {
+      ++d;
+    }
+    return d;
+  };
+
+  int vt100CoordOffset = _displayCoords ? 2 : 0;
+  encodeBands(
+      bandCount,
+      [&](FrameEncoding &e, size_t band) {
+        // The cursor is left just past the last tile drawn before the band,
+        // and the attributes are those of the last one drawn with any.
+        bool cursorFound = false;
+        for (size_t d = bandStart(band); d-- > 0;) {
+          unsigned consoleIndex = _dirtyTileIndexes[d];
+          int r = consoleIndex / _viewportColCount;
+          int c = consoleIndex % _viewportColCount;
+          size_t i = viewportTileIndex(r, c);
+          if (_glyphs[i] == _consoleGlyphs[consoleIndex] &&
+              _colors[i] == _consoleColors[consoleIndex]) {
+            continue; // not drawn
+          }
+
+          if (!cursorFound) {
+            e.cursorRow = r + 2 + vt100CoordOffset;
+            e.cursorCol = 2 * c + 3 + vt100CoordOffset;
+            cursorFound = true;
+          }
+          if (_glyphs[i] != '\0') {
+            e.attributes = _colors[i];
+            return;
+          } else if (_displayEmptyTileDots) {
+            e.attributes = kDimAttributes;
+            return;
+          }
+        }
+      },
+      [&](FrameEncoding &e, size_t band) {
+        encodeDirtyTiles(e, bandStart(band), bandStart(band + 1));
+      });
+
+  // The console is now showing the dirty tiles.
+  for (unsigned consoleIndex : _dirtyTileIndexes) {
+    size_t i = viewportTileIndex(consoleIndex / _viewportColCount,
+                                 consoleIndex % _viewportColCount);
+    _consoleGlyphs[consoleIndex] = _glyphs[i];
+    _consoleColors[consoleIndex] = _colors[i];
+  }
+  clearDirtyTiles();
+
+  if (_displayCoords) {
+    if (_viewportMoved) {
+      updateAllCoords();
+    } else {
+      updateHighlightedCoords();
+    }
+  }
+  _viewportMoved = false;
+
+  _encoding.frame += "\x1B"
+                     "8"; // restore cursor & attrs
+
+  // The cursor & attrs are now as they were before the frame, i.e. unknown.
+  _encoding.cursorRow = kIllegalCoord;
+  _encoding.cursorCol = kIllegalCoord;
+  _encoding.attributes = kUnknownAttributes;
+
+  // Drawn in the same frame as the tiles. Like a redraw, the log leaves the
+  // cursor below its last line, for anything printed after it.
+  if (_messageDirty) {
+    drawMessage();
+  }
+  drawLog();
+}
+
+int GameBoard::firstLogLineVT100Row() const {
+  return firstMessageLineVT100Row() + _messageLines.size();
+}
+
+int GameBoard::firstMessageLineVT100Row() const {
+  return _viewportRowCount + 3 + (_displayCoords ? 4 : 0);
+}
+
+void GameBoard::drawMessage() const {
+  _messageDirty = false;
+  FrameTrace::Span span("drawMessage");
+  steady_clock::time_point start = steady_clock::now();
+  _encoding.frame += "\x1B"
+                     "7"; // save cursor & attrs
+  unsigned char savedAttributes = _encoding.attributes;
+  setAttributes(_encoding, Color::defaultColor);
+
+  int firstRow = firstMessageLineVT100Row();
+  size_t messageCount = _messageLines.size();
+  for (int i = 0; i < messageCount; ++i) {
+    appendCursorPosition(_encoding.frame, firstRow + i, 0);
+    _encoding.frame += "\x1B[2K"; // erase line
+    _encoding.frame += _messageLines[i];
+    _encoding.frame += '\n';
+  }
+  _encoding.stats.cursorMoveCount += messageCount;
+
+  _encoding.frame += "\x1B"
+                     "8"; // restore cursor & attrs
+  _encoding.attributes = savedAttributes;
+  _encoding.stats.messageDuration += steady_clock::now() - start;
+}
+
+void GameBoard::drawLog() const {
+  /* Draws the lines logged since the log was last drawn. The log's rows are a
+  DECSTBM scroll region while the older lines are scrolled up, by a newline at
+  its bottom, to make room for the new ones, so the cost of logging a line
+  doesn't depend on how many rows the log has. Once every line displayed
+  would be scrolled out, the rows are simply rewritten.
+  */
+  if (_undrawnLogLineCount == 0 && !_logCleared) {
+    return;
+  }
+
+  FrameTrace::Span span("drawLog");
+  steady_clock::time_point start = steady_clock::now();
+  setAttributes(_encoding, Color::defaultColor);
+
+  // Only the rows showing lines need erasing.
+  int firstRow = firstLogLineVT100Row();
+  if (_logCleared) {
+    if (_drawnLogLineCount > 0) {
+      appendCursorPosition(_encoding.frame, firstRow, 0);
+      _encoding.stats.cursorMoveCount += 1;
+      for (size_t i = 0; i < _drawnLogLineCount; ++i) {
+        _encoding.frame += (i == 0) ? "\x1B[2K" : "\x1B[B\x1B[2K"; // down, erase line
+      }
+    }
+    _drawnLogLineCount = 0;
+    _logCleared = false;
+  }
+
+  size_t newCount = min(_undrawnLogLineCount, _loggedLineCount);
+  size_t rowCount = _drawnLogLineCount + newCount;
+  size_t scrollCount =
+      (rowCount > size_t(_logLineCount)) ? rowCount - _logLineCount : 0;
+  if (scrollCount > 0 && scrollCount >= _drawnLogLineCount) {
+    newCount = _loggedLineCount;
+    scrollCount = 0;
+    rowCount = newCount;
+  }
+
+  if (scrollCount > 0) {
+    int lastRow = firstRow + _logLineCount - 1;
+    _encoding.frame += "\x1B[";
+    appendNumber(_encoding.frame, firstRow);
+    _encoding.frame += ';';
+    appendNumber(_encoding.frame, lastRow);
+    _encoding.frame += 'r'; // set scroll region, which also homes the cursor
+    appendCursorPosition(_encoding.frame, lastRow, 0);
+    _encoding.frame.append(scrollCount, '\n');
+    _encoding.frame += "\x1B[r"; // reset scroll region
+    rowCount -= scrollCount;
+    _encoding.stats.cursorMoveCount += 1;
+  }
+
+  // The new lines are the last ones, in consecutive rows.
+  if (newCount > 0) {
+    appendCursorPosition(_encoding.frame, firstRow + rowCount - newCount, 0);
+    _encoding.stats.cursorMoveCount += 1;
+  }
+  for (size_t i = _loggedLineCount - newCount; i < _loggedLineCount; ++i) {
+    _encoding.frame += "\x1B[2K"; // erase line
+    _encoding.frame += logLine(i);
+    _encoding.frame += '\n';
+  }
+
+  _drawnLogLineCount = rowCount;
+  _undrawnLogLineCount = 0;
+  _encoding.stats.logDuration += steady_clock::now() - start;
+}
+
+void GameBoard::clearLog() {
+  // The lines are erased by the next updateConsole, see drawLog.
+  _firstLogLine = 0;
+  _loggedLineCount = 0;
+  _undrawnLogLineCount = 0;
+  _logCleared = true;
+  ++_logClearCount;
+}
+
+void GameBoard::setLogLineCount(int count) {
+  if (count < 0) {
+    throw std::out_of_range("GameBoard:: illegal log line count:" +
+                            to_string(count));
+  }
+
+  // Intended to be called _before_ the board is first drawn.
+  // No attempt is made to update existing log lines in the console.
+  size_t keptCount = min(_loggedLineCount, size_t(count));
+  vector<string> logLines(count);
+  for (size_t i = 0; i < keptCount; ++i) {
+    logLines[i] = std::move(_logLines[(_firstLogLine + _loggedLineCount -
+                                       keptCount + i) % _logLines.size()]);
+  }
+  _logLines = std::move(logLines);
+  _firstLogLine = 0;
+  _loggedLineCount = keptCount;
+  _logLineCount = count;
+  _drawnLogLineCount = min(_drawnLogLineCount, size_t(count));
+  _undrawnLogLineCount = min(_undrawnLogLineCount, size_t(count));
+}
+
+void GameBoard::updateRowCoords(int row) const {
+  if (row < _viewportRow || row >= _viewportRow + _viewportRowCount) {
+    return;
+  }
+
+  int vt100Row = row - _viewportRow + 4;
+  int vt100ColLeft = 1;
+  int vt100ColRight = _viewportColCount * 2 + 4;
+  row = coordLabel(_coordOriginRow + row);
+  moveCursor(_encoding, vt100Row, vt100ColLeft);
+  appendNumber(_encoding.frame, row, 2);
+  _encoding.cursorCol += 2;
+  moveCursor(_encoding, vt100Row, vt100ColRight);
+  appendNumber(_encoding.frame, row, 2, true);
+  _encoding.cursorCol += 2;
+}
+
+void GameBoard::updateColCoords(int col, bool eraseBlanks) const {
+  if (col < _viewportCol || col >= _viewportCol + _viewportColCount) {
+    return;
+  }
+
+  int vt100Row0 = 1;
+  int vt100Row1 = 2;
+  int vt100Row3 = _viewportRowCount + 5;
+  int vt100Row4 = _viewportRowCount + 6;
+  int vt100Col = (col - _viewportCol) * 2 + 4;
+  col = coordLabel(_coordOriginCol + col);
+
+  // When a single digit label replaces a two digit one, e.g. after the
+  // viewport moves, the unused digits must be erased.
+  if (col < 10 && eraseBlanks) {
+    moveCursor(_encoding, vt100Row0, vt100Col);
+    _encoding.frame += "  ";
+    _encoding.cursorCol += 2;
+  }
+
+  if (col > 9) {
+    moveCursor(_encoding, vt100Row0, vt100Col);
+    appendNumber(_encoding.frame, col / 10, 2, true);
+    _encoding.cursorCol += 2;
+  }
+
+  moveCursor(_encoding, vt100Row1, vt100Col);
+  appendNumber(_encoding.frame, col % 10, 2, true);
+  _encoding.cursorCol += 2;
+  moveCursor(_encoding, vt100Row3, vt100Col);
+  appendNumber(_encoding.frame, (col > 9) ? col / 10 : col, 2, true);
+  _encoding.cursorCol += 2;
+
+  if (col > 9 || eraseBlanks) {
+    moveCursor(_encoding, vt100Row4, vt100Col);
+    if (col > 9) {
+      appendNumber(_encoding.frame, col % 10, 2, true);
+    } else {
+      _encoding.frame += "  ";
+    }
+    _encoding.cursorCol += 2;
+  }
+}
+
+void GameBoard::updateAllCoords() const {
+  // After the viewport moves every label changes, not just highlighted ones.
+  int viewportRowEnd = _viewportRow + _viewportRowCount;
+  for (int row = _viewportRow; row < viewportRowEnd; ++row) {
+    bool highlight = row == _highlightedRow;
+    setAttributes(_encoding, highlight ? _highlightedCoordsColor
+                                       : Color::defaultColor);
+    updateRowCoords(row);
+  }
+
+  int viewportColEnd = _viewportCol + _viewportColCount;
+  for (int col = _viewportCol; col < viewportColEnd; ++col) {
+    bool highlight = col == _highlightedCol;
+    setAttributes(_encoding, highlight ? _highlightedCoordsColor
+                                       : Color::defaultColor);
+    updateColCoords(col, true);
+  }
+
+  _dirtyHighlightedRow = kIllegalCoord;
+  _dirtyHighlightedCol = kIllegalCoord;
+}
+
+void GameBoard::updateHighlightedCoords() const {
+  if (_highlightedRow != kIllegalCoord || _highlightedCol != kIllegalCoord) {
+    setAttributes(_encoding, _highlightedCoordsColor);
+    updateRowCoords(_highlightedRow);
+    updateColCoords(_highlightedCol);
+  }
+
+  if (_dirtyHighlightedRow != kIllegalCoord) {
+    setAttributes(_encoding, Color::defaultColor);
+    updateRowCoords(_dirtyHighlightedRow);
+    _dirtyHighlightedRow = kIllegalCoord;
+  }
 
   if (_dirtyHighlightedCol != kIllegalCoord) {
-    Tile::colorStart(Color::defaultColor);
+    setAttributes(_encoding, Color::defaultColor);
     updateColCoords(_dirtyHighlightedCol);
-    Tile::colorEnd(Color::defaultColor);
     _dirtyHighlightedCol = kIllegalCoord;
   }
 }
 
-char GameBoard::nethackCommandKey(char c) {
-  // https://nethackwiki.com/wiki/Direction
-  switch (c) {
-  case 'k':
-    return arrowUpKey;
-  case 'j':
-    return arrowDownKey;
-  case 'l':
-    return arrowRightKey;
-  case 'h':
-    return arrowLeftKey;
-  case 'y':
-    return arrowUpLeftKey;
-  case 'u':
-    return arrowUpRightKey;
-  case 'b':
-    return arrowDownLeftKey;
-  case 'n':
-    return arrowDownRightKey;
-  default:
-    return noKey;
+struct KeyBinding {
+  char key;
+  char commandKey;
+};
+
+// https://nethackwiki.com/wiki/Direction
+static const KeyBinding kNethackKeyBindings[] = {
+    {'k', GameBoard::arrowUpKey},       {'j', GameBoard::arrowDownKey},
+    {'l', GameBoard::arrowRightKey},    {'h', GameBoard::arrowLeftKey},
+    {'y', GameBoard::arrowUpLeftKey},   {'u', GameBoard::arrowUpRightKey},
+    {'b', GameBoard::arrowDownLeftKey}, {'n', GameBoard::arrowDownRightKey},
+};
+
+static const KeyBinding kWASDKeyBindings[] = {
+    {'w', GameBoard::arrowUpKey},    {'s', GameBoard::arrowDownKey},
+    {'d', GameBoard::arrowRightKey}, {'a', GameBoard::arrowLeftKey},
+};
+
+void GameBoard::setNethackKeyMode(bool nethackKeyMode) {
+  _nethackKeyMode = nethackKeyMode;
+  compileKeyBindings();
+}
+
+void GameBoard::setWASDKeyMode(bool wasdKeyMode) {
+  _wasdKeyMode = wasdKeyMode;
+  compileKeyBindings();
+}
+
+// Replaces the key's binding, if it has one, so rebinding keys as a game runs
+// doesn't grow the bindings.
+static void setCustomKeyBinding(vector<pair<char, char>> &bindings, char key,
+                                char commandKey) {
+  auto binding = find_if(bindings.begin(), bindings.end(),
+                         [key](const pair<char, char> &b) { return b.first == key; });
+  if (binding != bindings.end()) {
+    binding->second = commandKey;
+  } else {
+    bindings.emplace_back(key, commandKey);
+  }
+}
+
+void GameBoard::setKeyBinding(char key, char commandKey) {
+  setCustomKeyBinding(_customKeyBindings, key, commandKey);
+  compileKeyBindings();
+}
+
+void GameBoard::clearKeyBindings() {
+  _customKeyBindings.clear();
+  compileKeyBindings();
+}
+
+void GameBoard::compileKeyBindings() {
+  for (size_t i = 0; i < _keyBindings.size(); ++i) {
+    _keyBindings[i] = char(i);
+  }
+
+  // Nethack and WASD keys _don't_ overlap.
+
+  if (_nethackKeyMode) {
+    for (KeyBinding binding : kNethackKeyBindings) {
+      _keyBindings[(unsigned char)binding.key] = binding.commandKey;
+    }
+  }
+
+  if (_wasdKeyMode) {
+    for (KeyBinding binding : kWASDKeyBindings) {
+      _keyBindings[(unsigned char)binding.key] = binding.commandKey;
+    }
+  }
+
+  for (auto [key, commandKey] : _customKeyBindings) {
+    _keyBindings[(unsigned char)key] = commandKey;
+  }
+}
+
+char GameBoard::normalCommandKey(char c) const {
+  return _keyBindings[(unsigned char)c];
+}
+
+// Waits up to timeout for any of the file descriptors to have input, or
+// indefinitely if it's negative. ppoll is used where available for its
+// sub-millisecond timeout. Returns how many have input.
+static int waitForInput(struct pollfd *pollFDs, size_t count, nanoseconds timeout) {
+#if defined(__linux__)
+  struct timespec timeoutSpec;
+  timeoutSpec.tv_sec = timeout.count() / 1000000000;
+  timeoutSpec.tv_nsec = timeout.count() % 1000000000;
+  int readyCount = ppoll(pollFDs, count, (timeout < 0ns) ? nullptr : &timeoutSpec, nullptr);
+#else
+  int timeoutMillis = (timeout < 0ns) ? -1 : int(ceil<milliseconds>(timeout).count());
+  int readyCount = poll(pollFDs, count, timeoutMillis);
+#endif
+
+  if (readyCount < 0 && errno != EINTR) {
+    perror("poll()");
+  }
+  return max(readyCount, 0);
+}
+
+void GameBoard::setInputFileDescriptor(int fd) {
+  if (fd != _inputFileDescriptor) {
+    // Keys decoded from the old input don't carry over.
+    _inputFileDescriptor = fd;
+    _inputHead = _inputTail = 0;
+    _keyDecoder = KeyDecoder();
+    _terminalSession.reset();
+  }
+}
+
+bool GameBoard::readInput(nanoseconds timeout) {
+  // The console stays in raw mode from the first read on, so waiting for a
+  // key is just a poll and a read, rather than switching modes every time.
+  if (!_terminalSession && _inputFileDescriptor == STDIN_FILENO) {
+    _terminalSession.emplace();
+  }
+
+  if (_inputHead == _inputTail) {
+    _inputHead = _inputTail = 0;
+  }
+
+  size_t tailIndex = _inputTail % kInputBufferSize;
+  size_t freeCount = kInputBufferSize - (_inputTail - _inputHead);
+  if (freeCount == 0) {
+    return false; // the rest stays queued in the console until there's room
+  }
+
+  // A negative timeout waits indefinitely, in read rather than poll.
+  if (timeout >= 0ns) {
+    struct pollfd pollFD = {_inputFileDescriptor, POLLIN, 0};
+    if (waitForInput(&pollFD, 1, timeout) == 0) {
+      return false;
+    }
+  }
+
+  // Only reads up to the end of the buffer when the free space wraps around.
+  size_t contiguousCount = min(freeCount, kInputBufferSize - tailIndex);
+
+  ssize_t readCount = read(_inputFileDescriptor, &_inputBytes[tailIndex], contiguousCount);
+  if (readCount < 0 && errno != EINTR) {
+    perror("read()");
+  }
+  if (readCount <= 0) {
+    return false;
+  }
+
+  _inputTail += readCount;
+  _inputTime = steady_clock::now();
+  return true;
+}
+
+char GameBoard::inputByteAt(size_t offset) const {
+  return _inputBytes[(_inputHead + offset) % kInputBufferSize];
+}
+
+char GameBoard::decodeInputKey() {
+  // Returns noKey if the queued bytes run out before completing a key. Keys
+  // bound to noKey are skipped, rather than hiding the keys queued after them.
+  char key = noKey;
+  while (key == noKey && _inputHead != _inputTail) {
+    if (_keyDecoder.decode(inputByteAt(0), key)) {
+      ++_inputHead;
+    }
+    if (key != noKey) {
+      key = decodedCommandKey(key);
+    }
+  }
+
+  return key;
+}
+
+char GameBoard::decodedCommandKey(char key) const {
+  if (key == unknownKey) {
+    string_view sequence = _keyDecoder.sequence();
+    printf("Unrecognized key %zu bytes:", sequence.size());
+    for (char c : sequence) {
+      printf(" \\x%X ", (unsigned char)c);
+    }
+    cout << endl;
+  }
+
+  // Pasted text is returned as is, not interpreted as commands.
+  return _keyDecoder.pasting() ? key : normalCommandKey(key);
+}
+
+nanoseconds GameBoard::escapeTimeoutRemaining() const {
+  nanoseconds elapsed = steady_clock::now() - _inputTime;
+  return max(milliseconds(kEscapeTimeoutMillis) - elapsed, 0ns);
+}
+
+char GameBoard::nextCommandKey(unsigned timeout) {
+  if (timeout == 0) {
+    return nextCommandKeyUntil(steady_clock::time_point::max());
+  }
+  return nextCommandKeyFor(milliseconds(timeout * 100));
+}
+
+char GameBoard::nextCommandKeyFor(microseconds timeout) {
+  return nextCommandKeyUntil(steady_clock::now() + timeout);
+}
+
+char GameBoard::nextCommandKeyUntil(steady_clock::time_point deadline) {
+  FrameTrace::Span span("inputWait");
+  fflush(stdout);
+
+  for (;;) {
+    // Keys that arrived together are queued and returned by subsequent calls,
+    // rather than discarded.
+    if (char key = decodeInputKey()) {
+      return key;
+    }
+
+    // A negative timeout waits indefinitely. Waiting for the rest of an
+    // escape sequence never runs past the caller's deadline, a lone escape
+    // key is returned by a later call instead.
+    nanoseconds timeout = -1ns;
+    if (_keyDecoder.pending()) {
+      timeout = escapeTimeoutRemaining();
+      if (timeout == 0ns) {
+        if (char key = decodedCommandKey(_keyDecoder.flush())) {
+          return key;
+        }
+        continue; // the escape key is bound to noKey
+      }
+    }
+    if (deadline != steady_clock::time_point::max()) {
+      nanoseconds remaining = deadline - steady_clock::now();
+      if (remaining <= 0ns) {
+        return noKey;
+      }
+      timeout = (timeout < 0ns) ? remaining : min(timeout, remaining);
+    }
+
+    // A signal, e.g. SIGWINCH, interrupting the wait isn't a timeout.
+    errno = 0;
+    if (!readInput(timeout) && errno != EINTR && !_keyDecoder.pending()) {
+      return noKey;
+    }
+  }
+}
+
+char GameBoard::tryNextKey() {
+  fflush(stdout);
+
+  char key = decodeInputKey();
+  if (key == noKey && readInput(0ns)) {
+    key = decodeInputKey();
+  }
+
+  if (key == noKey && _keyDecoder.pending() && escapeTimeoutRemaining() == 0ns) {
+    key = decodedCommandKey(_keyDecoder.flush());
+  }
+
+  return key;
+}
+
+steady_clock::time_point GameBoard::escapeKeyDeadline() const {
+  if (!_keyDecoder.pending()) {
+    return steady_clock::time_point::max();
+  }
+  return _inputTime + milliseconds(kEscapeTimeoutMillis);
+}
+
+void GameBoard::pollKeys(vector<char> &keys) {
+  while (char key = tryNextKey()) {
+    keys.push_back(key);
+  }
+}
+
+GameBoard::KeyAwaiter GameBoard::nextKey() {
+  return KeyAwaiter(*this, steady_clock::time_point::max());
+}
+
+GameBoard::KeyAwaiter GameBoard::nextKey(microseconds timeout) {
+  return KeyAwaiter(*this, steady_clock::now() + timeout);
+}
+
+bool GameBoard::KeyAwaiter::await_ready() {
+  _key = _board.tryNextKey();
+  return _key != noKey || (_deadline != steady_clock::time_point::max() &&
+                           steady_clock::now() >= _deadline);
+}
+
+void GameBoard::KeyAwaiter::await_suspend(coroutine_handle<> handle) {
+  EventLoop *loop = EventLoop::current();
+  if (!loop) {
+    throw std::logic_error("GameBoard:: nextKey awaited outside an EventLoop");
+  }
+  loop->_waiters.push_back({handle, _deadline, &_board, &_key});
+}
+
+#define KEY_NAME(key)                                                          \
+  { GameBoard::key, #key }
+
+struct NamedKey {
+  char key;
+  const char *name;
+};
+
+// Shared by printCommandKey and loadKeyBindings.
+static const NamedKey kNamedKeys[] = {
+    KEY_NAME(noKey),
+    KEY_NAME(unknownKey),
+    KEY_NAME(arrowUpKey),
+    KEY_NAME(arrowDownKey),
+    KEY_NAME(arrowRightKey),
+    KEY_NAME(arrowLeftKey),
+    KEY_NAME(arrowUpLeftKey),
+    KEY_NAME(arrowUpRightKey),
+    KEY_NAME(arrowDownLeftKey),
+    KEY_NAME(arrowDownRightKey),
+    KEY_NAME(tabKey),
+    KEY_NAME(enterKey),
+    KEY_NAME(escapeKey),
+    KEY_NAME(deleteKey),
+    KEY_NAME(pageUpKey),
+    KEY_NAME(pageDownKey),
+    KEY_NAME(deleteForwardKey),
+    KEY_NAME(homeKey),
+    KEY_NAME(endKey),
+    KEY_NAME(insertKey),
+    KEY_NAME(backTabKey),
+    KEY_NAME(f1Key),
+    KEY_NAME(f2Key),
+    KEY_NAME(f3Key),
+    KEY_NAME(f4Key),
+    KEY_NAME(f5Key),
+    KEY_NAME(f6Key),
+    KEY_NAME(f7Key),
+    KEY_NAME(f8Key),
+    KEY_NAME(f9Key),
+    KEY_NAME(f10Key),
+    KEY_NAME(f11Key),
+    KEY_NAME(f12Key),
+    KEY_NAME(shiftArrowUpKey),
+    KEY_NAME(shiftArrowDownKey),
+    KEY_NAME(shiftArrowRightKey),
+    KEY_NAME(shiftArrowLeftKey),
+    KEY_NAME(altArrowUpKey),
+    KEY_NAME(altArrowDownKey),
+    KEY_NAME(altArrowRightKey),
+    KEY_NAME(altArrowLeftKey),
+    KEY_NAME(ctrlArrowUpKey),
+    KEY_NAME(ctrlArrowDownKey),
+    KEY_NAME(ctrlArrowRightKey),
+    KEY_NAME(ctrlArrowLeftKey),
+    KEY_NAME(pasteStartKey),
+    KEY_NAME(pasteEndKey),
+    KEY_NAME(nonASCIIKey),
+};
+
+#undef KEY_NAME
+
+void GameBoard::printCommandKey(char cmd) {
+  for (NamedKey namedKey : kNamedKeys) {
+    if (namedKey.key == cmd) {
+      printf("%s\n", namedKey.name);
+      return;
+    }
+  }
+
+  printf("\\x%X (%u) '%c'\n", cmd, cmd, cmd);
+}
+
+static string_view trimmed(string_view str) {
+  size_t first = str.find_first_not_of(" \t\r");
+  if (first == string_view::npos) {
+    return string_view();
+  }
+  size_t last = str.find_last_not_of(" \t\r");
+  return str.substr(first, last - first + 1);
+}
+
+// Parses a keymap key, returning false if it's not one.
+static bool parseKey(string_view str, char &key) {
+  if (str.size() == 1) {
+    key = str[0];
+    return true;
+  }
+
+  if (str.size() == 3 && str[0] == '\'' && str[2] == '\'') {
+    key = str[1];
+    return true;
+  }
+
+  for (NamedKey namedKey : kNamedKeys) {
+    if (str == namedKey.name) {
+      key = namedKey.key;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void GameBoard::loadKeyBindings(string_view keymap) {
+  vector<pair<char, char>> bindings;
+
+  int lineNumber = 0;
+  while (!keymap.empty()) {
+    size_t lineLength = min(keymap.find('\n'), keymap.size());
+    string_view line = keymap.substr(0, lineLength);
+    keymap.remove_prefix(min(lineLength + 1, keymap.size()));
+    ++lineNumber;
+
+    // A # starts a comment, unless it's the quoted char '#'.
+    size_t commentStart = line.find('#');
+    while (commentStart != string_view::npos && commentStart > 0 &&
+           line[commentStart - 1] == '\'' && commentStart + 1 < line.size() &&
+           line[commentStart + 1] == '\'') {
+      commentStart = line.find('#', commentStart + 1);
+    }
+    line = trimmed(line.substr(0, commentStart));
+    if (line.empty()) {
+      continue;
+    }
+
+    // The = can itself be a key, e.g. "= = arrowUpKey" or "x = '='".
+    size_t keyLength = (line.size() >= 3 && line[0] == '\'' && line[2] == '\'') ? 3 : 1;
+    size_t equalsIndex = line.find('=', keyLength);
+    char key, commandKey;
+    if (equalsIndex == string_view::npos ||
+        !parseKey(trimmed(line.substr(0, equalsIndex)), key) ||
+        !parseKey(trimmed(line.substr(equalsIndex + 1)), commandKey)) {
+      throw std::invalid_argument("GameBoard:: illegal key binding on line " +
+                                  to_string(lineNumber) + ": " + string(line));
+    }
+
+    bindings.emplace_back(key, commandKey);
+  }
+
+  for (auto [key, commandKey] : bindings) {
+    setCustomKeyBinding(_customKeyBindings, key, commandKey);
+  }
+  compileKeyBindings();
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+Tile::Tile(char glyph, Color color) : _glyph(glyph), _color(color) {}
+
+Tile::Tile(char glyph) : Tile::Tile(glyph, Color::defaultColor) {}
+
+bool Tile::operator==(const Tile &rhs) const {
+  return _glyph == rhs._glyph && _color == rhs._color;
+}
+
+bool Tile::operator!=(const Tile &rhs) const { return !(*this == rhs); }
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+// The terminal's settings before the first session, restored by the last.
+// Only plain data is touched by the signal handler, as it can run at any time.
+static struct termios sSavedTerminalAttrs;
+static volatile sig_atomic_t sTerminalIsRaw = 0;
+static volatile sig_atomic_t sBracketedPaste = 0;
+static int sTerminalSessionCount = 0;
+static bool sTerminalSignalHandlersInstalled = false;
+
+static const int kRestoringSignals[] = {SIGHUP, SIGINT, SIGQUIT, SIGTERM};
+static struct sigaction sPreviousSignalActions[size(kRestoringSignals)];
+
+// The raw settings, put back after the process is stopped, e.g. by ctrl-z, and
+// continued. While it's stopped by ctrl-z, the terminal's restored, and what
+// was on is remembered for SIGCONT.
+static struct termios sRawTerminalAttrs;
+static volatile sig_atomic_t sSuspendedRaw = 0;
+static volatile sig_atomic_t sSuspendedBracketedPaste = 0;
+static struct sigaction sPreviousSuspendAction;
+static struct sigaction sPreviousContinueAction;
+
+static void writeBracketedPaste(bool bracketedPaste) {
+  static const char kOn[] = "\x1B[?2004h";
+  static const char kOff[] = "\x1B[?2004l";
+
+  ssize_t writeCount = bracketedPaste ? write(STDOUT_FILENO, kOn, sizeof(kOn) - 1)
+                                      : write(STDOUT_FILENO, kOff, sizeof(kOff) - 1);
+  (void)writeCount; // nothing more to be done if it fails
+  sBracketedPaste = bracketedPaste;
+}
+
+static void restoreTerminal() {
+  if (sBracketedPaste) {
+    writeBracketedPaste(false);
+  }
+
+  if (sTerminalIsRaw) {
+    tcsetattr(STDIN_FILENO, TCSADRAIN, &sSavedTerminalAttrs);
+    sTerminalIsRaw = 0;
+  }
+}
+
+static void reapplyTerminal() {
+  if (sTerminalIsRaw || sSuspendedRaw) {
+    tcsetattr(STDIN_FILENO, TCSANOW, &sRawTerminalAttrs);
+    sTerminalIsRaw = 1;
+  }
+  if (sBracketedPaste || sSuspendedBracketedPaste) {
+    writeBracketedPaste(true);
+  }
+  sSuspendedRaw = 0;
+  sSuspendedBracketedPaste = 0;
+}
+
+static void registerRestoreTerminalAtExit() {
+  static bool registered = false;
+  if (!registered) {
+    atexit(restoreTerminal);
+    registered = true;
+  }
+}
+
+static void restoreTerminalSignalHandler(int signalNumber) {
+  restoreTerminal();
+
+  /* Put back whatever handled the signal before the session started, and
+   * resend the signal to it. It's delivered once this handler returns. */
+  for (size_t i = 0; i < size(kRestoringSignals); ++i) {
+    if (kRestoringSignals[i] == signalNumber) {
+      sigaction(signalNumber, &sPreviousSignalActions[i], nullptr);
+    }
+  }
+  raise(signalNumber);
+}
+
+static void suspendTerminalSignalHandler(int signalNumber) {
+  int savedErrno = errno;
+  sSuspendedRaw = sTerminalIsRaw;
+  sSuspendedBracketedPaste = sBracketedPaste;
+  restoreTerminal();
+
+  /* Stop the way the signal would have without this handler, by resending it
+   * to the previous action, unblocked so it's delivered right away. Once the
+   * process is continued, SIGCONT has normally put the terminal back. */
+  struct sigaction action;
+  sigaction(signalNumber, &sPreviousSuspendAction, &action);
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, signalNumber);
+  raise(signalNumber);
+  sigprocmask(SIG_UNBLOCK, &signals, nullptr);
+  sigaction(signalNumber, &action, nullptr);
+
+  if (sSuspendedRaw || sSuspendedBracketedPaste) {
+    reapplyTerminal();
+  }
+  errno = savedErrno;
+}
+
+static void continueTerminalSignalHandler(int) {
+  // The shell may have changed the settings while the process was stopped.
+  int savedErrno = errno;
+  reapplyTerminal();
+  errno = savedErrno;
+}
+
+TerminalSession::TerminalSession() {
+  if (sTerminalSessionCount++ > 0) {
+    return;
+  }
+
+  if (tcgetattr(STDIN_FILENO, &sSavedTerminalAttrs) < 0) {
+    return; // not a terminal, nothing to restore
+  }
+
+  registerRestoreTerminalAtExit();
+
+  struct sigaction action = {};
+  action.sa_handler = restoreTerminalSignalHandler;
+  sigemptyset(&action.sa_mask);
+  for (size_t i = 0; i < size(kRestoringSignals); ++i) {
+    sigaction(kRestoringSignals[i], nullptr, &sPreviousSignalActions[i]);
+    if (sPreviousSignalActions[i].sa_handler != SIG_IGN) {
+      sigaction(kRestoringSignals[i], &action, nullptr);
+    }
+  }
+
+  // A shell without job control ignores ctrl-z, and so does the session.
+  sigaction(SIGTSTP, nullptr, &sPreviousSuspendAction);
+  sigaction(SIGCONT, nullptr, &sPreviousContinueAction);
+  if (sPreviousSuspendAction.sa_handler != SIG_IGN) {
+    action.sa_handler = suspendTerminalSignalHandler;
+    sigaction(SIGTSTP, &action, nullptr);
+    action.sa_handler = continueTerminalSignalHandler;
+    sigaction(SIGCONT, &action, nullptr);
+  }
+  sTerminalSignalHandlersInstalled = true;
+
+  // Reads wait for at least one char, and return as soon as there is one.
+  sRawTerminalAttrs = sSavedTerminalAttrs;
+  sRawTerminalAttrs.c_cc[VMIN] = 1;
+  sRawTerminalAttrs.c_cc[VTIME] = 0;
+  sRawTerminalAttrs.c_lflag &= (~ICANON) & (~ECHO);
+
+  if (tcsetattr(STDIN_FILENO, TCSANOW, &sRawTerminalAttrs) < 0) {
+    perror("tcsetattr rawAttrs");
+  } else {
+    sTerminalIsRaw = 1;
+  }
+}
+
+TerminalSession::~TerminalSession() {
+  if (--sTerminalSessionCount > 0) {
+    return;
+  }
+
+  fflush(stdout);
+  restoreTerminal();
+
+  if (sTerminalSignalHandlersInstalled) {
+    for (size_t i = 0; i < size(kRestoringSignals); ++i) {
+      if (sPreviousSignalActions[i].sa_handler != SIG_IGN) {
+        sigaction(kRestoringSignals[i], &sPreviousSignalActions[i], nullptr);
+      }
+    }
+    if (sPreviousSuspendAction.sa_handler != SIG_IGN) {
+      sigaction(SIGTSTP, &sPreviousSuspendAction, nullptr);
+      sigaction(SIGCONT, &sPreviousContinueAction, nullptr);
+    }
+    sTerminalSignalHandlersInstalled = false;
+  }
+}
+
+bool TerminalSession::isRaw() { return sTerminalIsRaw; }
+
+void TerminalSession::setBracketedPaste(bool bracketedPaste) {
+  if (bracketedPaste != bool(sBracketedPaste)) {
+    registerRestoreTerminalAtExit();
+    fflush(stdout);
+    writeBracketedPaste(bracketedPaste);
+  }
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+static const char kPasteEnd[] = "\x1B[201~";
+
+// The special keys share the high-bit values with the bytes of UTF-8 chars, so
+// a non-ASCII char is returned as one nonASCIIKey, for its first byte.
+static char asciiKey(char byte) {
+  if ((unsigned char)byte < 0x80) {
+    return byte;
+  }
+  return ((unsigned char)byte >= 0xC0) ? GameBoard::nonASCIIKey : GameBoard::noKey;
+}
+
+bool KeyDecoder::decode(char byte, char &key) {
+  key = GameBoard::noKey;
+
+  switch (_state) {
+  case groundState:
+    if (byte == '\x1B') {
+      _state = escapeState;
+      startSequence(byte);
+    } else {
+      key = asciiKey(byte);
+    }
+    return true;
+
+  case escapeState:
+    if (byte == '[' || byte == 'O') {
+      _state = (byte == '[') ? csiState : ss3State;
+      _ignoredSequence = false;
+      _paramCount = 0;
+      _params[0] = _params[1] = 0;
+      startSequence('\x1B');
+      _sequence[_sequenceLength++] = byte;
+      return true;
+    }
+    // The escape key on its own, followed by another key.
+    _state = groundState;
+    key = GameBoard::escapeKey;
+    return false;
+
+  case ss3State:
+    _state = groundState;
+    if (byte >= 0x40 && byte <= 0x7E) {
+      _sequence[_sequenceLength++] = byte;
+      key = ss3Key(byte);
+      return true;
+    }
+    key = GameBoard::unknownKey;
+    return false;
+
+  case csiState:
+    if (byte < 0x20 || byte > 0x7E) {
+      // Not part of a sequence, the sequence was cut short.
+      _state = groundState;
+      key = GameBoard::unknownKey;
+      return false;
+    }
+    if (_sequenceLength < sizeof(_sequence)) {
+      _sequence[_sequenceLength++] = byte;
+    }
+
+    /* "\x1B[" {parameter bytes 0x30-0x3F} {intermediate bytes 0x20-0x2F}
+     * {final byte 0x40-0x7E}. Only the first two numeric parameters are
+     * needed, e.g. the key and modifier in "\x1B[1;5A". Sequences with
+     * private parameters or intermediates are not keys we know. */
+    if (byte >= '0' && byte <= '9') {
+      if (_paramCount == 0) {
+        _paramCount = 1;
+      }
+      if (_paramCount <= 2) {
+        unsigned short &param = _params[_paramCount - 1];
+        param = min(param * 10 + (byte - '0'), 9999);
+      }
+      return true;
+    }
+    if (byte == ';') {
+      _paramCount = min(max(int(_paramCount), 1) + 1, 3);
+      return true;
+    }
+    if (byte >= 0x20 && byte <= 0x3F) {
+      _ignoredSequence = true;
+      return true;
+    }
+
+    _state = groundState;
+    key = _ignoredSequence ? GameBoard::unknownKey : csiKey(byte);
+    if (key == GameBoard::pasteStartKey) {
+      _state = pasteState;
+    }
+    return true;
+
+  case pasteState:
+    /* Pasted text is passed through until "\x1B[201~". Bytes that start to
+     * match it, but don't finish, were pasted, and are replayed before the
+     * byte that didn't match is decoded. */
+    if (_pasteEndMatchCount > 0 && byte != kPasteEnd[_pasteEndMatchCount]) {
+      key = kPasteEnd[_pasteEndReplayCount++];
+      if (_pasteEndReplayCount == _pasteEndMatchCount) {
+        _pasteEndMatchCount = _pasteEndReplayCount = 0;
+      }
+      return false;
+    }
+    if (byte == kPasteEnd[_pasteEndMatchCount]) {
+      if (++_pasteEndMatchCount == sizeof(kPasteEnd) - 1) {
+        _state = groundState;
+        _pasteEndMatchCount = 0;
+        key = GameBoard::pasteEndKey;
+      }
+      return true;
+    }
+    key = asciiKey(byte);
+    return true;
+  }
+
+  return true;
+}
+
+bool KeyDecoder::pending() const {
+  return _state == escapeState || _state == csiState || _state == ss3State;
+}
+
+char KeyDecoder::flush() {
+  State state = _state;
+  if (!pending()) {
+    return GameBoard::noKey;
   }
+
+  _state = groundState;
+  return (state == escapeState) ? GameBoard::escapeKey : GameBoard::unknownKey;
 }
 
-char GameBoard::wasdCommandKey(char c) {
-  switch (c) {
-  case 'w':
-    return arrowUpKey;
-  case 's':
-    return arrowDownKey;
-  case 'd':
-    return arrowRightKey;
-  case 'a':
-    return arrowLeftKey;
+string_view KeyDecoder::sequence() const {
+  return string_view(_sequence, _sequenceLength);
+}
+
+void KeyDecoder::startSequence(char byte) {
+  _sequence[0] = byte;
+  _sequenceLength = 1;
+}
+
+char KeyDecoder::csiKey(char finalByte) const {
+  // Modifiers are sent as 1 + a bit mask: shift = 1, alt = 2, ctrl = 4.
+  int modifiers = (_paramCount >= 2 && _params[1] > 0) ? _params[1] - 1 : 0;
+
+  switch (finalByte) {
+  case 'A':
+  case 'B':
+  case 'C':
+  case 'D': {
+    int arrow = finalByte - 'A';
+    if (modifiers & 4) {
+      return char(GameBoard::ctrlArrowUpKey + arrow);
+    } else if (modifiers & 2) {
+      return char(GameBoard::altArrowUpKey + arrow);
+    } else if (modifiers & 1) {
+      return char(GameBoard::shiftArrowUpKey + arrow);
+    }
+    return char(GameBoard::arrowUpKey + arrow);
+  }
+  case 'H':
+    return GameBoard::homeKey;
+  case 'F':
+    return GameBoard::endKey;
+  case 'Z':
+    return GameBoard::backTabKey;
+  case 'P':
+  case 'Q':
+  case 'R':
+  case 'S':
+    return char(GameBoard::f1Key + (finalByte - 'P'));
+  case '~':
+    break;
+  default:
+    return GameBoard::unknownKey;
+  }
+
+  // "\x1B[{n}~" keys, numbered per the VT220, with gaps between the F-keys.
+  switch (_params[0]) {
+  case 1:
+  case 7:
+    return GameBoard::homeKey;
+  case 2:
+    return GameBoard::insertKey;
+  case 3:
+    return GameBoard::deleteForwardKey;
+  case 4:
+  case 8:
+    return GameBoard::endKey;
+  case 5:
+    return GameBoard::pageUpKey;
+  case 6:
+    return GameBoard::pageDownKey;
+  case 11:
+  case 12:
+  case 13:
+  case 14:
+  case 15:
+    return char(GameBoard::f1Key + (_params[0] - 11));
+  case 17:
+  case 18:
+  case 19:
+  case 20:
+  case 21:
+    return char(GameBoard::f6Key + (_params[0] - 17));
+  case 23:
+  case 24:
+    return char(GameBoard::f11Key + (_params[0] - 23));
+  case 200:
+    return GameBoard::pasteStartKey;
+  case 201:
+    return GameBoard::pasteEndKey;
   default:
-    return noKey;
+    return GameBoard::unknownKey;
   }
 }
 
-char GameBoard::escapedCommandKey(char c) {
-  // Interpret special keys based on the 3rd char of 3 or 4.
-  // "\x1B[{c}" or "\x1B[{c}~"
-  switch (c) {
+char KeyDecoder::ss3Key(char finalByte) {
+  // Sent instead of CSI sequences when the terminal is in application mode.
+  switch (finalByte) {
   case 'A':
-    return arrowUpKey;
   case 'B':
-    return arrowDownKey;
   case 'C':
-    return arrowRightKey;
   case 'D':
-    return arrowLeftKey;
-  case '3':
-    return deleteForwardKey;
-  case '5':
-    return pageUpKey;
-  case '6':
-    return pageDownKey;
+    return char(GameBoard::arrowUpKey + (finalByte - 'A'));
+  case 'H':
+    return GameBoard::homeKey;
+  case 'F':
+    return GameBoard::endKey;
+  case 'P':
+  case 'Q':
+  case 'R':
+  case 'S':
+    return char(GameBoard::f1Key + (finalByte - 'P'));
   default:
-    return unknownKey;
+    return GameBoard::unknownKey;
   }
 }
 
-char GameBoard::normalCommandKey(char c) const {
-  char result = c;
+/*****************************************************************************/
+/*****************************************************************************/
 
-  // Nethack and WASD keys _don't_ overlap.
+GameLoop::GameLoop(GameBoard &board, microseconds tickInterval,
+                   microseconds renderInterval)
+    : _board(board), _tickInterval(tickInterval),
+      _renderInterval(renderInterval) {
+  if (tickInterval <= 0us || renderInterval < 0us) {
+    throw std::out_of_range("GameLoop:: illegal tickInterval(" +
+                            to_string(tickInterval.count()) +
+                            "us) or renderInterval(" +
+                            to_string(renderInterval.count()) + "us)");
+  }
+}
 
-  if (_nethackKeyMode) {
-    if (char newC = nethackCommandKey(c)) {
-      result = newC;
+void GameLoop::run(const function<void(span<const char> keys)> &tick) {
+  _stopped = false;
+  _nextTickTime = _nextRenderTime = steady_clock::now();
+
+  while (!_stopped) {
+    // Keys are gathered while waiting for the next tick or render.
+    steady_clock::time_point deadline = _nextTickTime;
+    if (_renderInterval > 0us) {
+      deadline = min(deadline, _nextRenderTime);
+    }
+    while (char key = _board.nextCommandKeyUntil(deadline)) {
+      _keys.push_back(key);
+    }
+
+    bool ticked = runDueTicks(tick);
+
+    bool renderDue = (_renderInterval > 0us)
+                         ? steady_clock::now() >= _nextRenderTime
+                         : ticked;
+    if (renderDue && !_stopped) {
+      render();
     }
   }
+}
 
-  if (_wasdKeyMode) {
-    if (char newC = wasdCommandKey(c)) {
-      result = newC;
+bool GameLoop::runDueTicks(const function<void(span<const char> keys)> &tick) {
+  bool ticked = false;
+
+  for (int i = 0; !_stopped; ++i) {
+    steady_clock::time_point now = steady_clock::now();
+    if (now < _nextTickTime) {
+      break;
+    }
+
+    nanoseconds lateness = now - _nextTickTime;
+    if (i == kMaxCatchUpTickCount) {
+      int64_t droppedCount = lateness / _tickInterval + 1;
+      _stats.droppedTickCount += droppedCount;
+      _nextTickTime += droppedCount * _tickInterval;
+      break;
     }
+
+    auto latenessMicros = duration_cast<microseconds>(lateness);
+    _stats.totalTickLateness += latenessMicros;
+    _stats.totalSquaredTickLateness +=
+        double(latenessMicros.count()) * latenessMicros.count();
+    _stats.minTickLateness = (_stats.tickCount == 0)
+                                 ? latenessMicros
+                                 : min(_stats.minTickLateness, latenessMicros);
+    _stats.maxTickLateness = max(_stats.maxTickLateness, latenessMicros);
+    if (lateness >= _tickInterval) {
+      ++_stats.lateTickCount;
+    }
+
+    tick(_keys);
+    _keys.clear();
+    ++_stats.tickCount;
+    _nextTickTime += _tickInterval;
+    ticked = true;
   }
 
-  return result;
+  return ticked;
 }
 
-char GameBoard::nextCommandKey(unsigned timeout) {
-  char result = noKey;
+void GameLoop::render() {
+  steady_clock::time_point start = steady_clock::now();
 
-  fflush(stdout);
+  if (_renderInterval > 0us) {
+    nanoseconds lateness = start - _nextRenderTime;
+    if (lateness >= _renderInterval) {
+      int64_t skippedCount = lateness / _renderInterval;
+      ++_stats.lateRenderCount;
+      _stats.skippedRenderCount += skippedCount;
+      _nextRenderTime += skippedCount * _renderInterval;
+    }
+    _nextRenderTime += _renderInterval;
+  }
+
+  _board.updateConsole();
+
+  auto duration = duration_cast<microseconds>(steady_clock::now() - start);
+  ++_stats.renderCount;
+  _stats.totalRenderDuration += duration;
+  _stats.maxRenderDuration = max(_stats.maxRenderDuration, duration);
+}
+
+microseconds GameLoop::Stats::meanTickLateness() const {
+  return tickCount ? totalTickLateness / int64_t(tickCount) : 0us;
+}
+
+microseconds GameLoop::Stats::tickLatenessDeviation() const {
+  if (tickCount == 0) {
+    return 0us;
+  }
+
+  double mean = double(totalTickLateness.count()) / tickCount;
+  double variance = totalSquaredTickLateness / tickCount - mean * mean;
+  return microseconds(llround(sqrt(max(variance, 0.0))));
+}
+
+microseconds GameLoop::Stats::meanRenderDuration() const {
+  return renderCount ? totalRenderDuration / int64_t(renderCount) : 0us;
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+AsyncRenderer::AsyncRenderer(GameBoard &board) : _board(board) {
+  resizeDisplayBoard(board.viewportRowCount(), board.viewportColCount());
+  _renderThread = thread([this] { renderSnapshots(); });
+}
+
+AsyncRenderer::~AsyncRenderer() {
+  _middleSnapshot.fetch_or(kStopRendering, memory_order_release);
+  _middleSnapshot.notify_one();
+  _renderThread.join();
+}
+
+void AsyncRenderer::present() {
+  capture(_snapshots[_backSnapshot]);
 
-  struct termios oldAttrs = {0};
-  if (tcgetattr(0, &oldAttrs) < 0) {
-    perror("tcgetattr()");
+  // Publishes the snapshot, taking back whichever one was waiting, or was
+  // last drawn, to fill next time.
+  unsigned previous = _middleSnapshot.exchange(_backSnapshot | kFreshSnapshot,
+                                               memory_order_acq_rel);
+  _backSnapshot = previous & kSnapshotIndexMask;
+  if (previous & kFreshSnapshot) {
+    ++_skippedCount;
   }
+  ++_presentedCount;
 
-  struct termios newAttrs = oldAttrs;
+  _middleSnapshot.notify_one();
+}
 
-  cc_t vMin = (timeout == 0) ? 1 : 0; // sychronous, wait for at least one char
-  cc_t vTime = timeout;
-  newAttrs.c_cc[VMIN] = vMin;
-  newAttrs.c_cc[VTIME] = vTime;
-  newAttrs.c_lflag &= (~ICANON) & (~ECHO);
+void AsyncRenderer::capture(Snapshot &snapshot) const {
+  // Assigning to the snapshot's vectors & strings reuses their capacity, so
+  // after the first few frames presenting doesn't allocate.
+  const GameBoard &board = _board;
+  snapshot.viewportRow = board._viewportRow;
+  snapshot.viewportCol = board._viewportCol;
+  snapshot.viewportRowCount = board._viewportRowCount;
+  snapshot.viewportColCount = board._viewportColCount;
+
+  size_t colCount = board._viewportColCount;
+  snapshot.glyphs.resize(board._viewportRowCount * colCount);
+  snapshot.colors.resize(board._viewportRowCount * colCount);
+  for (int r = 0; r < board._viewportRowCount; ++r) {
+    size_t i = board.viewportTileIndex(r, 0);
+    copy_n(&board._glyphs[i], colCount, &snapshot.glyphs[r * colCount]);
+    copy_n(&board._colors[i], colCount, &snapshot.colors[r * colCount]);
+  }
 
-  if (tcsetattr(0, TCSANOW, &newAttrs) < 0) {
-    perror("tcsetattr newAttrs");
+  snapshot.vt100Mode = board._vt100Mode;
+  snapshot.displayCoords = board._displayCoords;
+  snapshot.displayEmptyTileDots = board._displayEmptyTileDots;
+  snapshot.highlightedRow = board._highlightedRow;
+  snapshot.highlightedCol = board._highlightedCol;
+  snapshot.highlightedCoordsColor = board._highlightedCoordsColor;
+
+  snapshot.messageLines[0] = board._messageLines[0];
+  snapshot.messageLines[1] = board._messageLines[1];
+  snapshot.logLineCount = board._logLineCount;
+  snapshot.logLines.resize(board._loggedLineCount);
+  for (size_t i = 0; i < board._loggedLineCount; ++i) {
+    snapshot.logLines[i] = board.logLine(i);
   }
+  snapshot.totalLoggedLineCount = board._totalLoggedLineCount;
+  snapshot.logClearCount = board._logClearCount;
+}
 
-  // Discards queued up keys by only processing one key from buf.
-  // The alternative approach, only reading one key's worth, is complicated
-  // Esc sequences require looking ahead and pushing back chars if it turns
-  // out not to be an esc sequence.
-  char buf[32];
-  ssize_t readCount = read(0, buf, sizeof(buf));
-  if (readCount < 0) {
-    perror("read()");
+void AsyncRenderer::renderSnapshots() {
+  // Runs on the render thread, until stopped, with every snapshot presented
+  // before then drawn, or skipped.
+  for (;;) {
+    unsigned middle = _middleSnapshot.load(memory_order_acquire);
+    if (!(middle & kFreshSnapshot)) {
+      if (middle & kStopRendering) {
+        return;
+      }
+      _middleSnapshot.wait(middle, memory_order_acquire);
+      continue;
+    }
+
+    middle = _middleSnapshot.exchange(
+        _frontSnapshot | (middle & kStopRendering), memory_order_acq_rel);
+    _frontSnapshot = middle & kSnapshotIndexMask;
+    render(_snapshots[_frontSnapshot]);
+    ++_renderedCount;
   }
+}
 
-  if (readCount > 0) {
+void AsyncRenderer::render(const Snapshot &snapshot) {
+  // The display board is brought up to date with the snapshot, changing only
+  // what differs, so it draws just the changes, as it would for the game. It
+  // only holds the viewport, labeled with the viewport's coords.
+  if (_displayBoard->_rowCount != snapshot.viewportRowCount ||
+      _displayBoard->_colCount != snapshot.viewportColCount) {
+    resizeDisplayBoard(snapshot.viewportRowCount, snapshot.viewportColCount);
+  }
+  GameBoard &board = *_displayBoard;
 
-    if (readCount > 2 && buf[0] == '\x1B' && buf[1] == '[') {
-      result = escapedCommandKey(buf[2]);
-    } else {
-      result = normalCommandKey(buf[0]);
+  if (board._coordOriginRow != snapshot.viewportRow ||
+      board._coordOriginCol != snapshot.viewportCol) {
+    board._coordOriginRow = snapshot.viewportRow;
+    board._coordOriginCol = snapshot.viewportCol;
+    board._viewportMoved = true; // relabels the coords
+  }
+
+  copy(snapshot.glyphs.begin(), snapshot.glyphs.end(), board._glyphs);
+  copy(snapshot.colors.begin(), snapshot.colors.end(), board._colors);
+  board.setRowsStale(0, board._rowCount);
+
+  if (board._vt100Mode != snapshot.vt100Mode) {
+    board.setVT100Mode(snapshot.vt100Mode);
+  }
+  if (board._displayCoords != snapshot.displayCoords) {
+    board.setDisplayCoords(snapshot.displayCoords);
+  }
+  if (board._displayEmptyTileDots != snapshot.displayEmptyTileDots) {
+    board.setDisplayEmptyTileDots(snapshot.displayEmptyTileDots);
+  }
+  if (board._highlightedCoordsColor != snapshot.highlightedCoordsColor) {
+    board.setHighlightedCoordsColor(snapshot.highlightedCoordsColor);
+  }
+  // Highlighted coords outside the viewport aren't shown, like the game's.
+  auto displayCoord = [](int coord, int origin) {
+    return coord == kIllegalCoord ? kIllegalCoord : coord - origin;
+  };
+  board.setHighlightedCoords_(
+      displayCoord(snapshot.highlightedRow, snapshot.viewportRow),
+      displayCoord(snapshot.highlightedCol, snapshot.viewportCol));
+
+  for (int i = 0; i < 2; ++i) {
+    if (board._messageLines[i] != snapshot.messageLines[i]) {
+      board.setMessage(snapshot.messageLines[i], i);
+    }
+  }
+
+  if (board._logLineCount != snapshot.logLineCount) {
+    board.setLogLineCount(snapshot.logLineCount);
+  }
+  if (_renderedLogClearCount != snapshot.logClearCount) {
+    board.clearLog();
+    _renderedLogClearCount = snapshot.logClearCount;
+    _renderedLogLineCount =
+        snapshot.totalLoggedLineCount - snapshot.logLines.size();
+  }
+  size_t logCount = snapshot.logLines.size();
+  size_t newLineCount = min<uint64_t>(
+      snapshot.totalLoggedLineCount - _renderedLogLineCount, logCount);
+  for (size_t i = logCount - newLineCount; i < logCount; ++i) {
+    board.addLogLine(snapshot.logLines[i]);
+  }
+  _renderedLogLineCount = snapshot.totalLoggedLineCount;
+
+  board.updateConsole();
+}
+
+void AsyncRenderer::resizeDisplayBoard(int rowCount, int colCount) {
+  // A board's size is fixed, so a new display board replaces the old one,
+  // drawing the same way. It redraws everything, including the log lines.
+  const GameBoard &previous = _displayBoard ? *_displayBoard : _board;
+  RenderSink *renderSink = previous.renderSink();
+  int encodingThreadCount = previous.encodingThreadCount();
+
+  _displayBoard.emplace(rowCount, colCount);
+  _displayBoard->setViewportSize(rowCount, colCount);
+  _displayBoard->setRenderSink(renderSink);
+  _displayBoard->setEncodingThreadCount(encodingThreadCount);
+  _renderedLogLineCount = 0;
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+Task &Task::operator=(Task &&task) noexcept {
+  if (this != &task) {
+    if (_handle) {
+      _handle.destroy();
     }
+    _handle = task._handle;
+    task._handle = nullptr;
+  }
+  return *this;
+}
+
+Task::~Task() {
+  if (_handle) {
+    _handle.destroy();
+  }
+}
+
+static thread_local EventLoop *sCurrentEventLoop = nullptr;
+
+EventLoop *EventLoop::current() { return sCurrentEventLoop; }
+
+void EventLoop::spawn(Task task) {
+  _readyHandles.push_back(task._handle);
+  _tasks.push_back(std::move(task));
+}
 
-    if (result == unknownKey) {
-      printf("Unrecognized key %zu bytes:", readCount);
-      for (int i = 0; i < readCount; ++i) {
-        printf(" \\x%X ", buf[i]);
+void EventLoop::run() {
+  // Makes this the current loop, until run returns or throws.
+  struct CurrentEventLoop {
+    EventLoop *previous = sCurrentEventLoop;
+    CurrentEventLoop(EventLoop *loop) { sCurrentEventLoop = loop; }
+    ~CurrentEventLoop() { sCurrentEventLoop = previous; }
+  } current(this);
+
+  while (!_tasks.empty()) {
+    resumeReadyHandles();
+
+    if (!_tasks.empty()) {
+      if (_waiters.empty()) {
+        throw std::logic_error("EventLoop:: tasks are waiting on something "
+                               "other than a board or timer");
       }
-      cout << endl;
+      waitForWaiters();
     }
   }
+}
 
-  if (tcsetattr(0, TCSADRAIN, &oldAttrs) < 0) {
-    perror("tcsetattr oldAttrs");
+void EventLoop::resumeReadyHandles() {
+  // Handles readied while resuming wait for the next pass.
+  _resumingHandles.swap(_readyHandles);
+
+  for (size_t i = 0; i < _resumingHandles.size(); ++i) {
+    coroutine_handle<> handle = _resumingHandles[i];
+    handle.resume();
+
+    // Tasks are only ever suspended at their top level, so a finished handle
+    // is a task's.
+    if (handle.done()) {
+      auto taskIt = find_if(_tasks.begin(), _tasks.end(), [&](const Task &task) {
+        return task._handle.address() == handle.address();
+      });
+      exception_ptr exception = taskIt->_handle.promise()._exception;
+      _tasks.erase(taskIt);
+
+      if (exception) {
+        // The rest are resumed if run is called again.
+        _readyHandles.insert(_readyHandles.begin(), _resumingHandles.begin() + i + 1,
+                             _resumingHandles.end());
+        _resumingHandles.clear();
+        rethrow_exception(exception);
+      }
+    }
   }
 
-  return result;
+  _resumingHandles.clear();
 }
 
-void GameBoard::printCommandKey(char cmd) {
-#define NAMED_KEY_CASE(key)                                                    \
-  case key:                                                                    \
-    printf("%s\n", #key);                                                      \
-    break
-  switch (cmd) {
-    NAMED_KEY_CASE(noKey);
-    NAMED_KEY_CASE(unknownKey);
-    NAMED_KEY_CASE(arrowUpKey);
-    NAMED_KEY_CASE(arrowDownKey);
-    NAMED_KEY_CASE(arrowRightKey);
-    NAMED_KEY_CASE(arrowLeftKey);
-    NAMED_KEY_CASE(arrowUpLeftKey);
-    NAMED_KEY_CASE(arrowUpRightKey);
-    NAMED_KEY_CASE(arrowDownLeftKey);
-    NAMED_KEY_CASE(arrowDownRightKey);
-    NAMED_KEY_CASE(tabKey);
-    NAMED_KEY_CASE(enterKey);
-    NAMED_KEY_CASE(escapeKey);
-    NAMED_KEY_CASE(deleteKey);
-    NAMED_KEY_CASE(pageUpKey);
-    NAMED_KEY_CASE(pageDownKey);
-    NAMED_KEY_CASE(deleteForwardKey);
-  default:
-    printf("\\x%X (%u) '%c'\n", cmd, cmd, cmd);
-    break;
+void EventLoop::waitForWaiters() {
+  steady_clock::time_point deadline = steady_clock::time_point::max();
+  vector<struct pollfd> pollFDs;
+  pollFDs.reserve(_waiters.size());
+
+  for (const Waiter &waiter : _waiters) {
+    deadline = min(deadline, waiter.deadline);
+    if (waiter.board) {
+      deadline = min(deadline, waiter.board->escapeKeyDeadline());
+      pollFDs.push_back({waiter.board->inputFileDescriptor(), POLLIN, 0});
+    }
+  }
+
+  nanoseconds timeout = -1ns;
+  if (deadline != steady_clock::time_point::max()) {
+    timeout = max(deadline - steady_clock::now(), nanoseconds(0));
+  }
+  waitForInput(pollFDs.data(), pollFDs.size(), timeout);
+
+  // Readies the waiters with a key, or whose deadline has passed.
+  steady_clock::time_point now = steady_clock::now();
+  size_t pollFDIndex = 0;
+  for (size_t i = 0; i < _waiters.size(); ++i) {
+    Waiter &waiter = _waiters[i];
+    bool ready = now >= waiter.deadline;
+
+    if (waiter.board) {
+      bool readable = pollFDs[pollFDIndex++].revents != 0;
+      if (readable || now >= waiter.board->escapeKeyDeadline()) {
+        *waiter.key = waiter.board->tryNextKey();
+        ready = ready || *waiter.key != GameBoard::noKey;
+      }
+    }
+
+    if (ready) {
+      _readyHandles.push_back(waiter.handle);
+      waiter.handle = nullptr;
+    }
   }
-#undef NAMED_KEY_CASE
+
+  erase_if(_waiters, [](const Waiter &waiter) { return !waiter.handle; });
+}
+
+bool EventLoop::SleepAwaiter::await_ready() const {
+  return steady_clock::now() >= _deadline;
+}
+
+void EventLoop::SleepAwaiter::await_suspend(coroutine_handle<> handle) {
+  _loop._waiters.push_back({handle, _deadline, nullptr, nullptr});
+}
+
+EventLoop::SleepAwaiter EventLoop::sleepUntil(steady_clock::time_point deadline) {
+  return SleepAwaiter(*this, deadline);
+}
+
+EventLoop::SleepAwaiter EventLoop::sleepFor(microseconds duration) {
+  return SleepAwaiter(*this, steady_clock::now() + duration);
 }
 
 /*****************************************************************************/
 /*****************************************************************************/
 
-Tile::Tile(char glyph, Color color)
-    : _glyph(glyph), _color(color), _dirty(false) {}
+void FileDescriptorSink::write(string_view frame) {
+  const char *bytes = frame.data();
+  size_t remaining = frame.size();
+  while (remaining > 0) {
+    ssize_t writeCount = ::write(_fd, bytes, remaining);
+    if (writeCount < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("write()");
+      break;
+    }
+    bytes += writeCount;
+    remaining -= writeCount;
+  }
+}
+
+StdoutSink::StdoutSink() : FileDescriptorSink(STDOUT_FILENO) {}
 
-Tile::Tile(char glyph) : Tile::Tile(glyph, Color::defaultColor) {}
+void StdoutSink::write(string_view frame) {
+  // Anything the caller printed through cout/printf must precede the frame.
+  fflush(stdout);
+  FileDescriptorSink::write(frame);
+}
 
-Tile::Tile(const Tile &tile, bool dirty) : Tile(tile) { _dirty = dirty; }
+/*****************************************************************************/
+/*****************************************************************************/
 
-bool Tile::operator==(const Tile &rhs) {
-  return _glyph == rhs._glyph && _color == rhs._color;
+// The box drawing char displayed for a char in the VT100 line drawing set.
+static char32_t lineDrawingGlyph(char c) {
+  switch (c) {
+  case 'j': return U'┘';
+  case 'k': return U'┐';
+  case 'l': return U'┌';
+  case 'm': return U'└';
+  case 'n': return U'┼';
+  case 'q': return U'─';
+  case 't': return U'├';
+  case 'u': return U'┤';
+  case 'v': return U'┴';
+  case 'w': return U'┬';
+  case 'x': return U'│';
+  default: return (unsigned char)c;
+  }
+}
+
+static void appendUTF8(string &str, char32_t glyph) {
+  if (glyph < 0x80) {
+    str += char(glyph);
+  } else if (glyph < 0x800) {
+    str += char(0xC0 | (glyph >> 6));
+    str += char(0x80 | (glyph & 0x3F));
+  } else if (glyph < 0x10000) {
+    str += char(0xE0 | (glyph >> 12));
+    str += char(0x80 | ((glyph >> 6) & 0x3F));
+    str += char(0x80 | (glyph & 0x3F));
+  } else {
+    str += char(0xF0 | (glyph >> 18));
+    str += char(0x80 | ((glyph >> 12) & 0x3F));
+    str += char(0x80 | ((glyph >> 6) & 0x3F));
+    str += char(0x80 | (glyph & 0x3F));
+  }
 }
 
-bool Tile::operator!=(const Tile &rhs) { return !(*this == rhs); }
+// The index'th numeric parameter of a control sequence, e.g. 5 for index 1 of
+// "1;5", or defaultValue when it's missing or zero.
+static int controlParameter(string_view params, int index, int defaultValue) {
+  for (; index > 0; --index) {
+    size_t separator = params.find(';');
+    if (separator == string_view::npos) {
+      return defaultValue;
+    }
+    params.remove_prefix(separator + 1);
+  }
 
-// Use colorStart/colorEnd to bracket printing to stdout to draw in the
-// specified color.
+  int value = 0;
+  from_chars(params.data(), params.data() + params.size(), value);
+  return value > 0 ? value : defaultValue;
+}
 
-void Tile::colorStart(Color color) {
-  static const char *vt100ColorCodes[] = {
-      // Display attribute syntax: <ESC>[{attr1};...;{attrn}m
+HeadlessTerminal::HeadlessTerminal(int rowCount, int colCount)
+    : _rowCount(rowCount), _colCount(colCount) {
+  if (rowCount <= 0 || colCount <= 0) {
+    throw std::out_of_range("HeadlessTerminal:: illegal rowCount(" +
+                            to_string(rowCount) + ") or colCount(" +
+                            to_string(colCount) + ")");
+  }
+  reset();
+}
 
-      "\x1B[0m",    // default
-      "\x1B[30m",   // black
-      "\x1B[31m",   // red
-      "\x1B[32m",   // green
-      "\x1B[33m",   // yellow
-      "\x1B[34m",   // blue
-      "\x1B[35m",   // magenta
-      "\x1B[36m",   // cyan
-      "\x1B[37m",   // white
-      "\x1B[2;31m", // dark red
-      "\x1B[2;34m", // dark blue
-      "\x1B[2;37m", // dark white
-  };
+void HeadlessTerminal::reset() {
+  _cells.assign(size_t(_rowCount) * _colCount, Cell());
+  _cursorRow = _cursorCol = 0;
+  _scrollTop = 0;
+  _scrollBottom = _rowCount - 1;
+  _attributes = Cell();
+  _lineDrawing = false;
+  _savedCursorRow = _savedCursorCol = 0;
+  _savedAttributes = Cell();
+  _savedLineDrawing = false;
+  _byteCount = _escapeCount = 0;
+  _pending.clear();
+}
 
-  cout << vt100ColorCodes[color];
+const HeadlessTerminal::Cell &HeadlessTerminal::cellAt(int row, int col) const {
+  if (row < 0 || col < 0 || row >= _rowCount || col >= _colCount) {
+    throw std::out_of_range("HeadlessTerminal:: illegal row("s +
+                            to_string(row) + ") or col(" + to_string(col) +
+                            ")");
+  }
+  return _cells[size_t(row) * _colCount + col];
 }
 
-void Tile::colorEnd(Color color) {
-  if (color != Color::defaultColor) {
-    cout << "\x1B[0m"; // reset attributes
+string HeadlessTerminal::rowText(int row) const {
+  cellAt(row, 0); // range check
+
+  string text;
+  const Cell *cells = &_cells[size_t(row) * _colCount];
+  int colEnd = _colCount;
+  while (colEnd > 0 && cells[colEnd - 1].glyph == U' ') {
+    --colEnd;
   }
+  for (int col = 0; col < colEnd; ++col) {
+    appendUTF8(text, cells[col].glyph);
+  }
+  return text;
 }
 
-// Called only by GameBoard to draw at the current cursor.
-void Tile::draw(bool displayEmptyTileDots) const {
-  if (_glyph != '\0') {
-    colorStart(_color);
-    cout << _glyph;
-    colorEnd(_color);
-  } else if (displayEmptyTileDots) {
-    cout << "\x1B[2m•\x1B[0m"; // dim, dot, reset
-  } else {
-    cout << ' ';
+void HeadlessTerminal::write(string_view frame) {
+  _byteCount += frame.size();
+
+  // A sequence or UTF-8 char split across writes is completed by this one.
+  string joined;
+  if (!_pending.empty()) {
+    joined = std::move(_pending);
+    joined += frame;
+    _pending.clear();
+    frame = joined;
+  }
+
+  size_t i = 0;
+  while (i < frame.size()) {
+    unsigned char byte = frame[i];
+
+    if (byte == '\x1B') {
+      size_t length = applySequence(frame.substr(i));
+      if (length == 0) {
+        break;
+      }
+      ++_escapeCount;
+      i += length;
+    } else if (byte == '\n') {
+      lineFeed();
+      ++i;
+    } else if (byte == '\r') {
+      _cursorCol = 0;
+      ++i;
+    } else if (byte < 0x20) {
+      ++i; // other control chars aren't used
+    } else if (byte < 0x80) {
+      putGlyph(_lineDrawing ? lineDrawingGlyph(byte) : byte);
+      ++i;
+    } else {
+      size_t length = (byte >= 0xF0) ? 4 : (byte >= 0xE0) ? 3 : (byte >= 0xC0) ? 2 : 1;
+      if (i + length > frame.size()) {
+        break;
+      }
+
+      char32_t glyph = (length == 1) ? byte : byte & (0x7F >> length);
+      for (size_t j = 1; j < length; ++j) {
+        glyph = (glyph << 6) | (frame[i + j] & 0x3F);
+      }
+      putGlyph(glyph);
+      i += length;
+    }
+  }
+
+  _pending = frame.substr(i);
+}
+
+size_t HeadlessTerminal::applySequence(string_view bytes) {
+  // Returns how many bytes the sequence is, or zero if it's incomplete.
+  if (bytes.size() < 2) {
+    return 0;
+  }
+
+  switch (bytes[1]) {
+  case '7':
+    _savedCursorRow = _cursorRow;
+    _savedCursorCol = _cursorCol;
+    _savedAttributes = _attributes;
+    _savedLineDrawing = _lineDrawing;
+    return 2;
+
+  case '8':
+    _cursorRow = _savedCursorRow;
+    _cursorCol = _savedCursorCol;
+    _attributes = _savedAttributes;
+    _lineDrawing = _savedLineDrawing;
+    return 2;
+
+  case '(':
+    if (bytes.size() < 3) {
+      return 0;
+    }
+    _lineDrawing = bytes[2] == '0';
+    return 3;
+
+  case '[':
+    for (size_t i = 2; i < bytes.size(); ++i) {
+      if (bytes[i] >= 0x40 && bytes[i] <= 0x7E) {
+        applyControlSequence(bytes.substr(2, i - 2), bytes[i]);
+        return i + 1;
+      }
+    }
+    return 0;
+
+  default:
+    return 2; // not used, ignored
+  }
+}
+
+void HeadlessTerminal::applyControlSequence(string_view params,
+                                            char finalByte) {
+  if (!params.empty() && params[0] == '?') {
+    return; // private modes, e.g. bracketed paste, don't affect the screen
+  }
+
+  int count = controlParameter(params, 0, 1);
+  switch (finalByte) {
+  case 'A':
+    _cursorRow = max(_cursorRow - count, 0);
+    break;
+  case 'B':
+    _cursorRow = min(_cursorRow + count, _rowCount - 1);
+    break;
+  case 'C':
+    _cursorCol = min(_cursorCol + count, _colCount - 1);
+    break;
+  case 'D':
+    _cursorCol = max(min(_cursorCol, _colCount - 1) - count, 0);
+    break;
+  case 'H':
+  case 'f':
+    _cursorRow = min(controlParameter(params, 0, 1), _rowCount) - 1;
+    _cursorCol = min(controlParameter(params, 1, 1), _colCount) - 1;
+    break;
+  case 'J': {
+    int mode = controlParameter(params, 0, 0);
+    size_t cursorIndex = size_t(_cursorRow) * _colCount + min(_cursorCol, _colCount);
+    if (mode == 0) {
+      fill(_cells.begin() + cursorIndex, _cells.end(), Cell());
+    } else if (mode == 1) {
+      fill(_cells.begin(), _cells.begin() + min(cursorIndex + 1, _cells.size()), Cell());
+    } else {
+      fill(_cells.begin(), _cells.end(), Cell());
+    }
+    break;
+  }
+  case 'K': {
+    int mode = controlParameter(params, 0, 0);
+    if (mode == 0) {
+      clearCells(_cursorRow, _cursorCol, _colCount - _cursorCol);
+    } else if (mode == 1) {
+      clearCells(_cursorRow, 0, _cursorCol + 1);
+    } else {
+      clearCells(_cursorRow, 0, _colCount);
+    }
+    break;
+  }
+  case 'm':
+    applyGraphicsRendition(params);
+    break;
+  case 'r': {
+    // An illegal region is ignored, a missing one is the whole screen.
+    int top = controlParameter(params, 0, 1) - 1;
+    int bottom = min(controlParameter(params, 1, _rowCount), _rowCount) - 1;
+    if (top < bottom) {
+      _scrollTop = top;
+      _scrollBottom = bottom;
+      _cursorRow = _cursorCol = 0;
+    }
+    break;
+  }
+  default:
+    break; // not used, ignored
+  }
+}
+
+void HeadlessTerminal::applyGraphicsRendition(string_view params) {
+  // An empty parameter, e.g. in "\x1B[m", is a reset.
+  for (;;) {
+    int code = controlParameter(params, 0, 0);
+    if (code == 0) {
+      _attributes = Cell();
+    } else if (code == 2) {
+      _attributes.dim = true;
+    } else if (code == 22) {
+      _attributes.dim = false;
+    } else if (code >= 30 && code <= 37) {
+      _attributes.color = foregroundColor(code);
+    } else if (code == 39) {
+      _attributes.color = Color::defaultColor;
+    }
+
+    size_t separator = params.find(';');
+    if (separator == string_view::npos) {
+      break;
+    }
+    params.remove_prefix(separator + 1);
+  }
+}
+
+void HeadlessTerminal::putGlyph(char32_t glyph) {
+  if (_cursorCol < _colCount) {
+    Cell &cell = _cells[size_t(_cursorRow) * _colCount + _cursorCol];
+    cell = _attributes;
+    cell.glyph = glyph;
+    ++_cursorCol;
+  }
+}
+
+void HeadlessTerminal::lineFeed() {
+  _cursorCol = 0;
+  if (_cursorRow == _scrollBottom) {
+    // Scrolls the scroll region up a line.
+    auto top = _cells.begin() + size_t(_scrollTop) * _colCount;
+    auto bottom = _cells.begin() + size_t(_scrollBottom) * _colCount;
+    move(top + _colCount, bottom + _colCount, top);
+    clearCells(_scrollBottom, 0, _colCount);
+  } else if (_cursorRow + 1 < _rowCount) {
+    ++_cursorRow;
+  }
+}
+
+void HeadlessTerminal::clearCells(int row, int col, int count) {
+  col = max(col, 0);
+  count = min(count, _colCount - col);
+  if (count > 0) {
+    fill_n(_cells.begin() + size_t(row) * _colCount + col, count, Cell());
+  }
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+// A recorded span. Its slot is claimed by incrementing sTraceSpanCount, and
+// the name is set last, so a span whose name is still null is being written.
+struct TraceSpan {
+  std::atomic<const char *> name;
+  int64_t startNanos;
+  int64_t durationNanos;
+  uint32_t threadID;
+};
+
+static unique_ptr<TraceSpan[]> sTraceSpans;
+static size_t sTraceSpanCapacity = 0;
+static std::atomic<size_t> sTraceSpanCount{0};
+static std::atomic<uint64_t> sDroppedTraceSpanCount{0};
+static steady_clock::time_point sTraceStartTime;
+
+// Threads are numbered in the trace in the order they first record a span.
+static uint32_t traceThreadID() {
+  static std::atomic<uint32_t> sNextThreadID{1};
+  thread_local uint32_t threadID = sNextThreadID++;
+  return threadID;
+}
+
+void FrameTrace::start(size_t spanCapacity) {
+  _recording = false;
+  if (spanCapacity != sTraceSpanCapacity) {
+    sTraceSpans.reset(new TraceSpan[spanCapacity]);
+    sTraceSpanCapacity = spanCapacity;
+  }
+  for (size_t i = 0; i < sTraceSpanCapacity; ++i) {
+    sTraceSpans[i].name = nullptr;
+  }
+  sTraceSpanCount = 0;
+  sDroppedTraceSpanCount = 0;
+  sTraceStartTime = steady_clock::now();
+  _recording = true;
+}
+
+void FrameTrace::stop() { _recording = false; }
+
+size_t FrameTrace::spanCount() {
+  return min(sTraceSpanCount.load(), sTraceSpanCapacity);
+}
+
+uint64_t FrameTrace::droppedSpanCount() { return sDroppedTraceSpanCount; }
+
+void FrameTrace::record(const char *name, steady_clock::time_point start,
+                        steady_clock::time_point end) {
+  size_t i = sTraceSpanCount.fetch_add(1, memory_order_relaxed);
+  if (i >= sTraceSpanCapacity) {
+    sDroppedTraceSpanCount.fetch_add(1, memory_order_relaxed);
+    return;
+  }
+
+  TraceSpan &span = sTraceSpans[i];
+  span.startNanos = duration_cast<nanoseconds>(start - sTraceStartTime).count();
+  span.durationNanos = duration_cast<nanoseconds>(end - start).count();
+  span.threadID = traceThreadID();
+  span.name.store(name, memory_order_release);
+}
+
+void FrameTrace::writeChromeTrace(ostream &out) {
+  // Complete ("X") events, with times in microseconds.
+  out << "{\"traceEvents\":[";
+  bool first = true;
+  size_t count = spanCount();
+  for (size_t i = 0; i < count; ++i) {
+    const TraceSpan &span = sTraceSpans[i];
+    const char *name = span.name.load(memory_order_acquire);
+    if (!name) {
+      continue;
+    }
+
+    out << (first ? "\n" : ",\n") << "{\"name\":\"";
+    for (const char *c = name; *c; ++c) {
+      if (*c == '"' || *c == '\\') {
+        out << '\\';
+      }
+      out << *c;
+    }
+
+    char times[64];
+    snprintf(times, sizeof(times), ",\"ts\":%.3f,\"dur\":%.3f",
+             span.startNanos / 1000.0, span.durationNanos / 1000.0);
+    out << "\",\"cat\":\"GameBoard\",\"ph\":\"X\"" << times
+        << ",\"pid\":1,\"tid\":" << span.threadID << "}";
+    first = false;
   }
+  out << "\n],\"displayTimeUnit\":\"ns\"}\n";
 }
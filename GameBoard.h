@@ -2,17 +2,110 @@
 #ifndef __GAME_BOARD_H__
 #define __GAME_BOARD_H__
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <span>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 #include <iostream>
 #include <sstream>
 
 class Tile;
+class EventLoop;
+class AsyncRenderer;
+class RenderSink;
+class HeadlessTerminal;
 enum Color : unsigned char;
 
 /*****************************************************************************/
 /*****************************************************************************/
 
+// A TerminalSession puts the console in raw mode (no line buffering or echo)
+// for as long as it exists. Sessions nest, only the first one changes the
+// terminal's settings and only the last one restores them. They're also
+// restored if the program exits, or is killed by a signal, while in raw mode,
+// and while it's stopped by ctrl-z, until it's continued.
+//
+// nextCommandKey starts a session for its board as needed. Creating one
+// yourself keeps the console in raw mode between boards.
+class TerminalSession {
+public:
+  TerminalSession();
+  ~TerminalSession();
+
+  TerminalSession(const TerminalSession &) = delete;
+  TerminalSession &operator=(const TerminalSession &) = delete;
+
+  // False if the input isn't a terminal, e.g. it's been redirected.
+  static bool isRaw();
+
+  // Bracketed paste mode has the terminal mark pasted text, so it's returned
+  // as literal chars between pasteStartKey and pasteEndKey, rather than being
+  // interpreted as commands. It's turned off when the terminal is restored.
+  static void setBracketedPaste(bool bracketedPaste);
+};
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+// A KeyDecoder turns the bytes read from the console into CommandKeys. It's
+// fed one byte at a time, so escape sequences split across reads are decoded
+// once the rest arrives. A lone escape key is indistinguishable from the start
+// of a sequence, until no more bytes arrive for a while, see flush. Non-ASCII
+// chars are decoded as a nonASCIIKey each, so they can't pass for special keys.
+class KeyDecoder {
+public:
+  // Sets key to the key the byte completes, or noKey. Returns false if the
+  // byte wasn't consumed, because it ended the previous key instead, in which
+  // case it needs to be decoded again.
+  bool decode(char byte, char &key);
+
+  // Whether part of an escape sequence has been decoded.
+  bool pending() const;
+
+  // Ends a pending escape sequence, returning the key decoded so far.
+  char flush();
+
+  // Whether the last key was part of bracketed paste text.
+  bool pasting() const { return _state == pasteState; }
+
+  // The bytes of the last escape sequence, e.g. to report unknownKeys.
+  std::string_view sequence() const;
+
+private:
+  enum State : unsigned char {
+    groundState,
+    escapeState, // after "\x1B"
+    csiState,    // after "\x1B["
+    ss3State,    // after "\x1BO"
+    pasteState,  // after "\x1B[200~", until "\x1B[201~"
+  };
+
+  State _state = groundState;
+  bool _ignoredSequence = false;
+  unsigned char _paramCount = 0;
+  unsigned short _params[2] = {};
+  unsigned char _pasteEndMatchCount = 0;
+  unsigned char _pasteEndReplayCount = 0;
+  unsigned char _sequenceLength = 0;
+  char _sequence[16];
+
+  void startSequence(char byte);
+  char csiKey(char finalByte) const;
+  static char ss3Key(char finalByte);
+};
+
+/*****************************************************************************/
+/*****************************************************************************/
+
 class GameBoard {
 public:
 
@@ -35,9 +128,58 @@ public:
   bool displayEmptyTileDots() const { return _displayEmptyTileDots; }
   void setDisplayEmptyTileDots(bool displayEmptyTileDots);
 
+  // The viewport is the part of the board displayed in the console. Its
+  // top-left tile is at viewportRow, viewportCol. By default it shows the
+  // whole board, up to 50x50 tiles.
+  int viewportRow() const { return _viewportRow; }
+  int viewportCol() const { return _viewportCol; }
+  void setViewport(int row, int col);
+
+  int viewportRowCount() const { return _viewportRowCount; }
+  int viewportColCount() const { return _viewportColCount; }
+  void setViewportSize(int rowCount, int colCount);
+
   void updateConsole() const;
   void redrawConsole() const;
 
+  // Where the board is drawn, stdout by default, see RenderSink. The board
+  // doesn't own the sink. Setting it to nullptr restores the default.
+  RenderSink *renderSink() const { return _renderSink; }
+  void setRenderSink(RenderSink *renderSink);
+
+  // How many threads compose the frames of large boards, each a band of rows.
+  // Zero, the default, means one per core, and one composes them serially. The
+  // frames are byte for byte the same either way.
+  int encodingThreadCount() const { return _encodingThreadCount; }
+  void setEncodingThreadCount(int threadCount);
+
+  // Whether the terminal shows the viewport's tiles as they are now, i.e.
+  // after updateConsole, in VT100 mode.
+  bool screenMatches(const HeadlessTerminal &terminal) const;
+
+  // What went into drawing frames, i.e. each batch of bytes sent to the render
+  // sink by updateConsole or redrawConsole. The durations overlap, redraws and
+  // updates include drawing the message & log.
+  struct FrameStats {
+    uint64_t frameCount = 0;
+    uint64_t redrawCount = 0; // full redraws, e.g. after setDisplayCoords
+    uint64_t updateCount = 0; // incremental updates
+    uint64_t tileCount = 0;   // tiles drawn, all the viewport's in a redraw
+    uint64_t cursorMoveCount = 0;
+    uint64_t attributeChangeCount = 0; // SGR sequences
+    uint64_t byteCount = 0;
+    std::chrono::nanoseconds redrawDuration{};
+    std::chrono::nanoseconds updateDuration{};
+    std::chrono::nanoseconds logDuration{};
+    std::chrono::nanoseconds messageDuration{};
+
+    FrameStats &operator+=(const FrameStats &stats);
+  };
+
+  const FrameStats &lastFrameStats() const { return _lastFrameStats; }
+  const FrameStats &totalFrameStats() const { return _totalFrameStats; }
+  void resetFrameStats();
+
   std::string message(int messageLineNumber = 0) const;
   void setMessage(std::string newMessage = "", int messageLineNumber = 0);
 
@@ -51,9 +193,37 @@ public:
   void clearTileAt(int row, int col);
   void clearLog();
 
+  // Bulk alternatives to setTileAt, for filling or copying many tiles at once.
+  struct Rect {
+    int row;
+    int col;
+    int rowCount;
+    int colCount;
+  };
+
+  void fillRect(Rect rect, Tile tile);
+  void setRow(int row, std::span<const Tile> tiles);
+  void blit(const GameBoard &source, Rect sourceRect, int row, int col);
+  void drawText(int row, int col, std::string_view text, Color color);
+
   char glyphAt(int row, int col) const;
   void setGlyphAt(int row, int col, char glyph);
 
+  // Layers are planes of tiles stacked on the board, bottom (0) to top, e.g.
+  // terrain, items and sprites, in which empty tiles are transparent. The
+  // board shows the topmost tile at each position, and only positions where
+  // that changes are redrawn. Tiles set on the board directly show until a
+  // layer changes at their position.
+  int layerCount() const { return int(_layers.size()); }
+  void setLayerCount(int count);
+
+  Tile layerTileAt(int layer, int row, int col) const;
+  void setLayerTileAt(int layer, int row, int col, Tile tile);
+  void clearLayerTileAt(int layer, int row, int col);
+  void moveLayerTile(int layer, int row, int col, int toRow, int toCol);
+  void fillLayerRect(int layer, Rect rect, Tile tile);
+  void clearLayer(int layer);
+
   // Commands are generally just the character pressed, e.g. 'a', ' ', 'x'.
   // This enum provides constants representing special keys, e.g. the arrow keys - listed below.
   enum CommandKey : char;
@@ -64,22 +234,69 @@ public:
   // until giving up and returning noKey.
   char nextCommandKey(unsigned timeout = 0);
 
+  // Like nextCommandKey, but waiting until a deadline, or for a duration, with
+  // sub-millisecond precision. Waiting until a deadline lets a loop run at a
+  // steady rate, e.g. adding 1/60 s to the deadline each frame, however soon
+  // keys are pressed.
+  char nextCommandKeyUntil(std::chrono::steady_clock::time_point deadline);
+  char nextCommandKeyFor(std::chrono::microseconds timeout);
+
+  // pollKeys appends every key pressed, but not yet returned by nextCommandKey,
+  // to keys. It doesn't wait, if no keys have been pressed it appends nothing.
+  void pollKeys(std::vector<char> &keys);
+
+  // The file descriptor keys are read from, stdin by default. It can be
+  // watched by an event loop, e.g. with epoll, calling tryNextKey until it
+  // returns noKey when it's readable, or pollKeys. Everything available is
+  // read at once, so keys left over, see hasBufferedKeys, won't make it
+  // readable again. The console is only put in raw mode when reading from
+  // stdin.
+  int inputFileDescriptor() const { return _inputFileDescriptor; }
+  void setInputFileDescriptor(int fd);
+
+  // Returns the next key pressed, or noKey, without waiting. A lone escape key
+  // isn't returned until escapeKeyDeadline, when the rest of an escape
+  // sequence would have arrived, so call it again then.
+  char tryNextKey();
+  std::chrono::steady_clock::time_point escapeKeyDeadline() const;
+
+  // Whether input has been read that tryNextKey hasn't returned yet.
+  bool hasBufferedKeys() const { return _inputHead != _inputTail; }
+
+  // co_await board.nextKey() in a Task waits for a key without blocking the
+  // thread, resuming with noKey if timeout elapses first, see EventLoop.
+  class KeyAwaiter;
+  KeyAwaiter nextKey();
+  KeyAwaiter nextKey(std::chrono::microseconds timeout);
+
   static void printCommandKey(char cmd);
 
   // Nethack mode interprets the nethack movement keys as arrow keys.
   // h = left, j = down, k = up, l = right (a la the vi editor)
   // y = up-left, u = up-right, b = down-left, n = down-right
   bool nethackKeyMode() const { return _nethackKeyMode; }
-  void setNethackKeyMode(bool nethackKeyMode) { _nethackKeyMode = nethackKeyMode; }
+  void setNethackKeyMode(bool nethackKeyMode);
 
   // WASD mode interprets the w, a, s, d keys as arrow keys.
   // w = up, a = left, s = down, r = right
   bool wasdKeyMode() const { return _wasdKeyMode; }
-  void setWASDKeyMode(bool wasdKeyMode) { _wasdKeyMode = wasdKeyMode; }
+  void setWASDKeyMode(bool wasdKeyMode);
+
+  // Key bindings have a key return a different command key, e.g. 'x' return
+  // deleteKey. They take precedence over the nethack and WASD modes, and apply
+  // to special keys too, e.g. f1Key. Binding a key to noKey has it ignored.
+  void setKeyBinding(char key, char commandKey);
+  void clearKeyBindings();
+
+  // Sets the bindings in keymap, one "key = commandKey" per line, where each
+  // is a single char, a quoted char (e.g. ' '), or a CommandKey's name (e.g.
+  // arrowUpKey). Blank lines, and text after a #, are ignored. Throws
+  // invalid_argument for a line it can't parse, setting none of the bindings.
+  void loadKeyBindings(std::string_view keymap);
 
   template <typename T>
   GameBoard& operator<<(T const& value) {
-    _stringStream << value;
+    _logStream << value;
     handleInsertion();
     return *this;
   }
@@ -87,54 +304,207 @@ public:
   // Special case to handle endl - which is a function.
   GameBoard& operator<<(std::ostream& (*func)(std::ostream&));
 
+protected:
+  // For subclasses providing their own (zero initialized) tile storage, e.g.
+  // StaticGameBoard. The board draws from it but doesn't own it.
+  GameBoard(int rowCount, int colCount, char *glyphs, Color *colors);
+
+  Tile tileAtIndex(size_t i) const;
+  void setTileAtIndex(size_t i, int row, int col, Tile tile);
+
+  void rangeCheck(int row, int col) const;
+
 private:
+  friend AsyncRenderer;
+
   bool _vt100Mode = true;
   bool _wasdKeyMode = false;
   bool _displayCoords = true;
   bool _nethackKeyMode = false;
   bool _displayEmptyTileDots = true;
   mutable bool _redrawNeeded = true;
+  mutable bool _viewportMoved = false;
   int _rowCount;
   int _colCount;
+  int _viewportRow = 0;
+  int _viewportCol = 0;
+  int _viewportRowCount = 0;
+  int _viewportColCount = 0;
+
+  // The coords labeling the board's first row & col, which are nonzero for a
+  // board showing the viewport of another one, see AsyncRenderer.
+  int _coordOriginRow = 0;
+  int _coordOriginCol = 0;
   int _highlightedRow;
   int _highlightedCol;
   int _logLineCount = 5;
   mutable int _dirtyHighlightedRow;
   mutable int _dirtyHighlightedCol;
   Color _highlightedCoordsColor;
+
+  // The streambuf behind operator<<. Inserted bytes are kept in a buffer that's
+  // reused from line to line, and only the bytes inserted since the last call
+  // to nextLine are searched for a newline.
+  class LogBuffer : public std::streambuf {
+  public:
+    LogBuffer();
+
+    // Returns the next complete line, which remains valid until the next call,
+    // or false once there are none.
+    bool nextLine(std::string_view &line);
+
+  protected:
+    int_type overflow(int_type c) override;
+
+  private:
+    std::vector<char> _bytes;
+    size_t _lineStart = 0;
+    size_t _scannedCount = 0;
+  };
+
+  // The last _logLineCount lines logged, in a ring of strings that are reused,
+  // along with their capacity, as newer lines replace older ones.
   std::vector<std::string> _logLines;
+  size_t _firstLogLine = 0;
+  size_t _loggedLineCount = 0;
+
+  // How many log rows the console is showing, and how many of the lines are
+  // newer than those, see drawLog. Message & log changes are drawn by the next
+  // update, in the same frame as the tiles.
+  mutable size_t _drawnLogLineCount = 0;
+  mutable size_t _undrawnLogLineCount = 0;
+  mutable bool _logCleared = false;
+  mutable bool _messageDirty = false;
+
+  // Lines logged, and clearLog calls, ever, for telling which lines are new.
+  uint64_t _totalLoggedLineCount = 0;
+  uint64_t _logClearCount = 0;
   std::vector<std::string> _messageLines = {"", ""};
-  std::ostringstream _stringStream;
-  Tile *_tiles;
+  LogBuffer _logBuffer;
+  std::ostream _logStream{&_logBuffer};
+  std::optional<TerminalSession> _terminalSession;
+  int _inputFileDescriptor = 0;
+
+  // Bytes read from the console, but not yet decoded into keys. The head and
+  // tail only ever increase, they're masked to index the buffer.
+  enum { kInputBufferSize = 256 };
+  std::array<char, kInputBufferSize> _inputBytes;
+  size_t _inputHead = 0;
+  size_t _inputTail = 0;
+  std::chrono::steady_clock::time_point _inputTime;
+  KeyDecoder _keyDecoder;
+
+  // The command key returned for each key, compiled from the nethack & WASD
+  // modes and _customKeyBindings, see compileKeyBindings. The slots with the
+  // high bit set are the special keys', as non-ASCII bytes are decoded as
+  // nonASCIIKey rather than passed through.
+  std::array<char, 256> _keyBindings;
+  std::vector<std::pair<char, char>> _customKeyBindings;
+
+  // Tiles are stored as separate glyph & color planes, rather than an array
+  // of Tile, so they can be compared many at a time, see diffTiles.
+  char *_glyphs;
+  Color *_colors;
+  bool _ownsTiles;
+
+  // Each layer's tiles, stored like the board's, which are composed from
+  // them, see composeTile.
+  struct TileLayer {
+    std::vector<char> glyphs;
+    std::vector<Color> colors;
+  };
+  std::vector<TileLayer> _layers;
+
+  // The tiles the console is showing at each viewport position.
+  mutable std::vector<char> _consoleGlyphs;
+  mutable std::vector<Color> _consoleColors;
+
+  // Dirty tracking, see setTileDirty.
+  mutable std::vector<uint64_t> _dirtyBits;
+  mutable std::vector<unsigned> _dirtyTileIndexes;
+
+  // Viewport rows to compare against the console tiles on the next update.
+  mutable std::vector<uint64_t> _staleRowBits;
+
+  // Each frame is composed in _encoding and passed to the render sink in one
+  // piece. The buffer is reused across frames to avoid reallocating.
+  RenderSink *_renderSink;
+  int _encodingThreadCount = 0;
+
+  // Bytes being composed, along with the cursor position & SGR attributes
+  // they leave the terminal in, and the stats of composing them. Bands of a
+  // large frame are composed in encodings of their own, see encodeBands.
+  struct FrameEncoding {
+    std::string frame;
+
+    // Where the bytes leave the cursor, or kIllegalCoord when unknown.
+    int cursorRow;
+    int cursorCol;
+
+    // The SGR attributes the bytes leave the terminal in, see setAttributes.
+    unsigned char attributes;
+
+    FrameStats stats;
+  };
+
+  // The frame being composed, the stats of the last one sent, and the totals.
+  mutable FrameEncoding _encoding;
+  mutable FrameStats _lastFrameStats;
+  mutable FrameStats _totalFrameStats;
+
+  // The band encodings, reused across frames to avoid reallocating.
+  mutable std::vector<FrameEncoding> _bandEncodings;
+
+  void flushFrame() const;
+
+  int cursorMoveCost(const FrameEncoding &e, int vt100Row, int vt100Col) const;
+  void moveCursor(FrameEncoding &e, int vt100Row, int vt100Col) const;
+  void setAttributes(FrameEncoding &e, unsigned char attributes) const;
+  void drawTile(FrameEncoding &e, Tile tile) const;
 
   void clearScreen() const;
-  void setDirtyOnAllTiles(bool dirty) const;
+  void setTileDirty(int row, int col) const;
+  void setViewportTileDirty(int viewportRow, int viewportCol) const;
+  void setRowsStale(int row, int rowCount);
+  void clearDirtyTiles() const;
 
   void redraw() const;
+  void collectDirtyTiles() const;
   void update() const;
 
+  size_t encodingBandCount(size_t tileCount) const;
+  void encodeBands(
+      size_t bandCount,
+      const std::function<void(FrameEncoding &, size_t)> &predictStart,
+      const std::function<void(FrameEncoding &, size_t)> &encode) const;
+  void encodeDirtyTiles(FrameEncoding &e, size_t first, size_t last) const;
+
   void drawTop(bool showCoords) const;
   void drawBottom(bool showCoords) const;
-  void drawRow(int row, bool showCoords) const;
+  void drawRow(FrameEncoding &e, int row, bool showCoords) const;
   void drawLog() const;
   void drawMessage() const;
 
-  // void log(std::string str);
-  void log(std::vector<std::string> strings);
+  void addLogLine(std::string_view line);
+  const std::string &logLine(size_t i) const;
   void handleInsertion();
 
   void updateRowCoords(int row) const;
-  void updateColCoords(int row) const;
+  void updateColCoords(int col, bool eraseBlanks = false) const;
   void updateHighlightedCoords() const;
+  void updateAllCoords() const;
   void setHighlightedCoords_(int row, int col); 
 
-  void rangeCheck(int row, int col) const;
+  void rangeCheck(Rect rect) const;
+  void layerRangeCheck(int layer) const;
+  void composeTile(size_t i, int row, int col);
 
-  unsigned tileIndex(int row, int col) const;
+  size_t tileIndex(int row, int col) const;
+  size_t viewportTileIndex(int viewportRow, int viewportCol) const;
   Tile displayedTileAt(int row, int col) const;
 
-  void vt100GraphicsEnd() const;
-  void vt100GraphicsStart() const;
+  void vt100GraphicsEnd(std::string &frame) const;
+  void vt100GraphicsStart(std::string &frame) const;
 
   char topLeftCornerGlyph() const;
   char topRightCornerGlyph() const;
@@ -143,10 +513,14 @@ private:
   char horizontalLineGlyph() const;
   char verticalLineGlyph() const;
 
+  bool readInput(std::chrono::nanoseconds timeout);
+  char inputByteAt(size_t offset) const;
+  char decodeInputKey();
+  char decodedCommandKey(char key) const;
+  std::chrono::nanoseconds escapeTimeoutRemaining() const;
+
+  void compileKeyBindings();
   char normalCommandKey(char c) const;
-  static char nethackCommandKey(char c);
-  static char wasdCommandKey(char c);
-  static char escapedCommandKey(char c);
 
   int firstLogLineVT100Row() const;
   int firstMessageLineVT100Row() const;
@@ -173,6 +547,61 @@ enum GameBoard::CommandKey : char {
   pageUpKey,
   pageDownKey,
   deleteForwardKey,
+  homeKey,
+  endKey,
+  insertKey,
+  backTabKey, // shift-tab
+
+  f1Key,
+  f2Key,
+  f3Key,
+  f4Key,
+  f5Key,
+  f6Key,
+  f7Key,
+  f8Key,
+  f9Key,
+  f10Key,
+  f11Key,
+  f12Key,
+
+  // Arrow keys with a modifier, in the same order as the arrow keys.
+  shiftArrowUpKey,
+  shiftArrowDownKey,
+  shiftArrowRightKey,
+  shiftArrowLeftKey,
+  altArrowUpKey,
+  altArrowDownKey,
+  altArrowRightKey,
+  altArrowLeftKey,
+  ctrlArrowUpKey,
+  ctrlArrowDownKey,
+  ctrlArrowRightKey,
+  ctrlArrowLeftKey,
+
+  // Bracket pasted text, see TerminalSession::setBracketedPaste.
+  pasteStartKey,
+  pasteEndKey,
+
+  // A non-ASCII char, typed or pasted. Its UTF-8 bytes have the high bit set,
+  // so they'd be mistaken for the special keys above, and aren't returned.
+  nonASCIIKey,
+};
+
+class GameBoard::KeyAwaiter {
+public:
+  bool await_ready();
+  void await_suspend(std::coroutine_handle<> handle);
+  char await_resume() const { return _key; }
+
+private:
+  friend GameBoard;
+  KeyAwaiter(GameBoard &board, std::chrono::steady_clock::time_point deadline)
+      : _board(board), _deadline(deadline) {}
+
+  GameBoard &_board;
+  std::chrono::steady_clock::time_point _deadline;
+  char _key = noKey;
 };
 
 /*****************************************************************************/
@@ -188,23 +617,14 @@ public:
   char glyph() const { return _glyph; };
   Color color() const { return _color; };
 
-  bool operator== (const Tile &rhs);
-  bool operator!= (const Tile &rhs);
+  bool operator== (const Tile &rhs) const;
+  bool operator!= (const Tile &rhs) const;
 
   friend GameBoard;
 
 private:
   char _glyph;
   Color _color;
-  bool _dirty;
-
-  Tile(const Tile &tile, bool dirty);
-  bool isDirty() const { return _dirty; };
-
-  static void colorEnd(Color color);
-  static void colorStart(Color color);
-
-  void draw(bool displayEmptyTiles = true) const;
 };
 
 /*****************************************************************************/
@@ -225,4 +645,489 @@ enum Color : unsigned char {
   gray, // dark white
 };
 
+/*****************************************************************************/
+/*****************************************************************************/
+
+// Unchecked accessors, inline so hot loops avoid a call per tile.
+
+inline Tile GameBoard::tileAtIndex(size_t i) const {
+  return Tile(_glyphs[i], _colors[i]);
+}
+
+inline void GameBoard::setTileAtIndex(size_t i, int row, int col, Tile tile) {
+  if (_glyphs[i] != tile._glyph || _colors[i] != tile._color) {
+    _glyphs[i] = tile._glyph;
+    _colors[i] = tile._color;
+    setTileDirty(row, col);
+  }
+}
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+// StaticGameBoard is a GameBoard whose size is fixed at compile time. Its tiles
+// are stored inline, rather than allocated, and board(row, col) accesses them
+// without the range checking done by tileAt/setTileAt, except in debug builds.
+// It draws exactly like any other GameBoard.
+
+template <int Rows, int Cols>
+struct StaticGameBoardStorage {
+  static_assert(Rows >= 0 && Cols >= 0);
+
+  // Initialized before the GameBoard base class, which is handed pointers to
+  // them, by being the first base class of StaticGameBoard.
+  std::array<char, size_t(Rows) * Cols> _staticGlyphs{};
+  std::array<Color, size_t(Rows) * Cols> _staticColors{};
+};
+
+template <int Rows, int Cols>
+class StaticGameBoard : private StaticGameBoardStorage<Rows, Cols>,
+                        public GameBoard {
+public:
+  StaticGameBoard()
+      : GameBoard(Rows, Cols, this->_staticGlyphs.data(),
+                  this->_staticColors.data()) {}
+
+  static constexpr size_t tileIndex(int row, int col) {
+    return size_t(row) * Cols + col;
+  }
+
+  // Allows board(row, col) = tile, marking the tile dirty like setTileAt.
+  class TileRef {
+  public:
+    operator Tile() const { return _board.tileAtIndex(tileIndex(_row, _col)); }
+
+    TileRef &operator=(Tile tile) {
+      _board.setTileAtIndex(tileIndex(_row, _col), _row, _col, tile);
+      return *this;
+    }
+
+  private:
+    friend StaticGameBoard;
+    TileRef(StaticGameBoard &board, int row, int col)
+        : _board(board), _row(row), _col(col) {}
+
+    StaticGameBoard &_board;
+    int _row;
+    int _col;
+  };
+
+  Tile operator()(int row, int col) const {
+    debugRangeCheck(row, col);
+    return tileAtIndex(tileIndex(row, col));
+  }
+
+  TileRef operator()(int row, int col) {
+    debugRangeCheck(row, col);
+    return TileRef(*this, row, col);
+  }
+
+private:
+  void debugRangeCheck(int row, int col) const {
+#ifndef NDEBUG
+    rangeCheck(row, col);
+#endif
+  }
+};
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+// A GameLoop runs a game at a fixed rate, however often keys are pressed, and
+// draws its board at a separate, typically lower, rate. Each tick is passed
+// the keys pressed since the previous tick, so the game plays the same
+// regardless of how fast the console draws.
+class GameLoop {
+public:
+  // A renderInterval of zero draws the board after every tick.
+  GameLoop(GameBoard &board, std::chrono::microseconds tickInterval,
+           std::chrono::microseconds renderInterval = {});
+
+  // Calls tick every tickInterval, and updates the board's console every
+  // renderInterval, until stop is called, e.g. by tick.
+  void run(const std::function<void(std::span<const char> keys)> &tick);
+  void stop() { _stopped = true; }
+
+  // When a tick or render starts after its scheduled time it's late, by that
+  // much. If it's so late the next one is already due, it's counted as late,
+  // and if a tick is still behind after several catch up ticks in a row, the
+  // ticks it's behind by are dropped. Renders that are behind are skipped.
+  struct Stats {
+    uint64_t tickCount = 0;
+    uint64_t lateTickCount = 0;
+    uint64_t droppedTickCount = 0;
+    uint64_t renderCount = 0;
+    uint64_t lateRenderCount = 0;
+    uint64_t skippedRenderCount = 0;
+    std::chrono::microseconds totalTickLateness{};
+    std::chrono::microseconds minTickLateness{};
+    std::chrono::microseconds maxTickLateness{};
+    double totalSquaredTickLateness = 0; // in microseconds squared
+    std::chrono::microseconds totalRenderDuration{};
+    std::chrono::microseconds maxRenderDuration{};
+
+    // The mean lateness of the ticks is how late they run on average, a bias
+    // the game won't notice. How much it varies, its standard deviation, is
+    // their timing jitter.
+    std::chrono::microseconds meanTickLateness() const;
+    std::chrono::microseconds tickLatenessDeviation() const;
+    std::chrono::microseconds meanRenderDuration() const;
+  };
+
+  const Stats &stats() const { return _stats; }
+  void resetStats() { _stats = Stats(); }
+
+private:
+  GameBoard &_board;
+  std::chrono::microseconds _tickInterval;
+  std::chrono::microseconds _renderInterval;
+  std::chrono::steady_clock::time_point _nextTickTime;
+  std::chrono::steady_clock::time_point _nextRenderTime;
+  bool _stopped = false;
+  std::vector<char> _keys;
+  Stats _stats;
+
+  bool runDueTicks(const std::function<void(std::span<const char> keys)> &tick);
+  void render();
+};
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+// An AsyncRenderer draws a board on a thread of its own, so a slow console
+// never holds up the game. The game changes the board as usual, and calls
+// present, instead of updateConsole, when it's ready to be seen. present copies
+// the viewport's tiles, the message and log, and the display settings into a
+// snapshot, and hands it over with an atomic swap, without waiting for the
+// render thread. The render thread draws the newest snapshot, through the
+// board's render sink, skipping any that were replaced before it got to them.
+//
+// Snapshots are triple buffered: one being filled by present, one waiting to
+// be drawn, and one being drawn.
+//
+// While an AsyncRenderer exists, only it should draw the board, and the board's
+// settings, other than through its own methods, shouldn't be changed.
+class AsyncRenderer {
+public:
+  explicit AsyncRenderer(GameBoard &board);
+
+  // Draws the last snapshot presented, then stops the render thread.
+  ~AsyncRenderer();
+
+  AsyncRenderer(const AsyncRenderer &) = delete;
+  AsyncRenderer &operator=(const AsyncRenderer &) = delete;
+
+  void present();
+
+  // Snapshots presented, and replaced by a newer one before they were drawn.
+  uint64_t presentedCount() const { return _presentedCount; }
+  uint64_t skippedCount() const { return _skippedCount; }
+  uint64_t renderedCount() const { return _renderedCount; }
+
+private:
+  struct Snapshot {
+    int viewportRow;
+    int viewportCol;
+    int viewportRowCount;
+    int viewportColCount;
+    std::vector<char> glyphs; // the viewport's tiles
+    std::vector<Color> colors;
+
+    bool vt100Mode;
+    bool displayCoords;
+    bool displayEmptyTileDots;
+    int highlightedRow;
+    int highlightedCol;
+    Color highlightedCoordsColor;
+
+    std::string messageLines[2];
+    int logLineCount;
+    std::vector<std::string> logLines; // oldest first
+    uint64_t totalLoggedLineCount;
+    uint64_t logClearCount;
+  };
+
+  // _middleSnapshot is the index of the snapshot waiting to be drawn, with
+  // kFreshSnapshot set until the render thread takes it.
+  enum : unsigned {
+    kSnapshotIndexMask = 0x3,
+    kFreshSnapshot = 0x4,
+    kStopRendering = 0x8,
+  };
+
+  GameBoard &_board;
+  // The render thread's copy of the board's viewport, sized to it.
+  std::optional<GameBoard> _displayBoard;
+  Snapshot _snapshots[3];
+  unsigned _backSnapshot = 0;
+  unsigned _frontSnapshot = 1;
+  std::atomic<unsigned> _middleSnapshot{2};
+
+  uint64_t _presentedCount = 0;
+  uint64_t _skippedCount = 0;
+  std::atomic<uint64_t> _renderedCount{0};
+
+  // The log lines the display board has been given.
+  uint64_t _renderedLogLineCount = 0;
+  uint64_t _renderedLogClearCount = 0;
+
+  std::thread _renderThread;
+
+  void capture(Snapshot &snapshot) const;
+  void renderSnapshots();
+  void render(const Snapshot &snapshot);
+  void resizeDisplayBoard(int rowCount, int colCount);
+};
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+// A Task is a coroutine run by an EventLoop. Tasks can co_await a board's
+// nextKey, or the loop's sleepFor/sleepUntil, so many boards and timers share
+// one thread without blocking it. E.g.
+//
+//   Task play(GameBoard &board) {
+//     while (char key = co_await board.nextKey()) {
+//       ...
+//     }
+//   }
+//
+//   EventLoop loop;
+//   loop.spawn(play(board1));
+//   loop.spawn(play(board2));
+//   loop.run();
+class Task {
+public:
+  struct promise_type {
+    std::exception_ptr _exception;
+
+    Task get_return_object() {
+      return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+    }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    std::suspend_always final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { _exception = std::current_exception(); }
+  };
+
+  Task(Task &&task) noexcept : _handle(task._handle) { task._handle = nullptr; }
+  Task &operator=(Task &&task) noexcept;
+  ~Task();
+
+private:
+  friend EventLoop;
+  explicit Task(std::coroutine_handle<promise_type> handle) : _handle(handle) {}
+
+  std::coroutine_handle<promise_type> _handle;
+};
+
+class EventLoop {
+public:
+  EventLoop() = default;
+  EventLoop(const EventLoop &) = delete;
+  EventLoop &operator=(const EventLoop &) = delete;
+
+  // Tasks start running when run is called, or right away if it's running.
+  void spawn(Task task);
+
+  // Runs the tasks until they've all finished. An exception thrown by a task
+  // ends that task, and is rethrown by run.
+  void run();
+
+  // The loop running on this thread, or nullptr.
+  static EventLoop *current();
+
+  class SleepAwaiter {
+  public:
+    bool await_ready() const;
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume() const {}
+
+  private:
+    friend EventLoop;
+    SleepAwaiter(EventLoop &loop, std::chrono::steady_clock::time_point deadline)
+        : _loop(loop), _deadline(deadline) {}
+
+    EventLoop &_loop;
+    std::chrono::steady_clock::time_point _deadline;
+  };
+
+  SleepAwaiter sleepUntil(std::chrono::steady_clock::time_point deadline);
+  SleepAwaiter sleepFor(std::chrono::microseconds duration);
+
+private:
+  friend GameBoard::KeyAwaiter;
+
+  // A suspended task, waiting for its deadline, or a key from board if any.
+  struct Waiter {
+    std::coroutine_handle<> handle;
+    std::chrono::steady_clock::time_point deadline;
+    GameBoard *board;
+    char *key;
+  };
+
+  std::vector<Task> _tasks;
+  std::vector<Waiter> _waiters;
+  std::vector<std::coroutine_handle<>> _readyHandles;
+  std::vector<std::coroutine_handle<>> _resumingHandles;
+
+  void resumeReadyHandles();
+  void waitForWaiters();
+};
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+// A RenderSink receives each frame a GameBoard draws, as the bytes that would
+// be written to a terminal, complete escape sequences and all.
+class RenderSink {
+public:
+  virtual ~RenderSink() = default;
+  virtual void write(std::string_view frame) = 0;
+};
+
+// Writes frames to a file descriptor, e.g. a pipe, socket or pseudo terminal.
+class FileDescriptorSink : public RenderSink {
+public:
+  explicit FileDescriptorSink(int fd) : _fd(fd) {}
+  int fileDescriptor() const { return _fd; }
+  void write(std::string_view frame) override;
+
+private:
+  int _fd;
+};
+
+// Writes frames to stdout, after flushing anything printed with cout/printf,
+// so it appears in order. The default sink.
+class StdoutSink : public FileDescriptorSink {
+public:
+  StdoutSink();
+  void write(std::string_view frame) override;
+};
+
+// A HeadlessTerminal applies frames to a grid of cells in memory, emulating
+// the parts of a VT100 GameBoard uses, e.g. for testing or benchmarking
+// without a terminal, including scroll regions. Like a terminal's default
+// settings, newlines also return to the first column. Chars past the last
+// column are dropped.
+class HeadlessTerminal : public RenderSink {
+public:
+  HeadlessTerminal(int rowCount = 100, int colCount = 200);
+
+  void write(std::string_view frame) override;
+
+  // Glyphs are Unicode code points, e.g. U'•', with the VT100 line drawing
+  // chars mapped to the equivalent box drawing chars, e.g. U'┌'.
+  struct Cell {
+    char32_t glyph = U' ';
+    Color color{};
+    bool dim = false;
+
+    bool operator==(const Cell &rhs) const = default;
+  };
+
+  int rowCount() const { return _rowCount; }
+  int colCount() const { return _colCount; }
+
+  // Rows & cols are numbered from zero, unlike VT100 escape sequences.
+  const Cell &cellAt(int row, int col) const;
+  std::string rowText(int row) const; // UTF-8
+  int cursorRow() const { return _cursorRow; }
+  int cursorCol() const { return _cursorCol; }
+
+  // Totals of everything written.
+  uint64_t byteCount() const { return _byteCount; }
+  uint64_t escapeCount() const { return _escapeCount; }
+
+  // Clears the screen and the totals.
+  void reset();
+
+private:
+  int _rowCount;
+  int _colCount;
+  std::vector<Cell> _cells;
+  int _cursorRow = 0;
+  int _cursorCol = 0;
+  Cell _attributes;
+  bool _lineDrawing = false;
+
+  // The rows a newline at the bottom of scrolls, set by DECSTBM.
+  int _scrollTop = 0;
+  int _scrollBottom = 0;
+
+  // ESC 7 saves the cursor & attributes, ESC 8 restores them.
+  int _savedCursorRow = 0;
+  int _savedCursorCol = 0;
+  Cell _savedAttributes;
+  bool _savedLineDrawing = false;
+
+  uint64_t _byteCount = 0;
+  uint64_t _escapeCount = 0;
+
+  // The start of a sequence split across writes.
+  std::string _pending;
+
+  size_t applySequence(std::string_view bytes);
+  void applyControlSequence(std::string_view params, char finalByte);
+  void applyGraphicsRendition(std::string_view params);
+  void putGlyph(char32_t glyph);
+  void lineFeed();
+  void clearCells(int row, int col, int count);
+};
+
+/*****************************************************************************/
+/*****************************************************************************/
+
+// FrameTrace records how long each phase of drawing a frame takes, e.g. the
+// update, the write and waiting for input, as spans in a fixed size buffer,
+// and writes them in the Chrome trace format, for chrome://tracing or
+// ui.perfetto.dev. Until start is called, a span costs one relaxed load.
+//
+// Spans can be recorded from any thread without locking. Once the buffer is
+// full, further spans are dropped, and counted.
+class FrameTrace {
+public:
+  // Starts recording, discarding any spans recorded before. Shouldn't be
+  // called while spans are being recorded on other threads.
+  static void start(size_t spanCapacity = 1 << 16);
+  static void stop();
+  static bool recording() { return _recording.load(std::memory_order_relaxed); }
+
+  static size_t spanCount();
+  static uint64_t droppedSpanCount();
+
+  // Writes the spans recorded so far as Chrome trace JSON.
+  static void writeChromeTrace(std::ostream &out);
+
+  // Records a span from its construction to its destruction, when recording.
+  // The name must outlive the trace, e.g. be a string literal.
+  class Span {
+  public:
+    explicit Span(const char *name) : _name(recording() ? name : nullptr) {
+      if (_name) {
+        _start = std::chrono::steady_clock::now();
+      }
+    }
+
+    ~Span() {
+      if (_name) {
+        record(_name, _start, std::chrono::steady_clock::now());
+      }
+    }
+
+    Span(const Span &) = delete;
+    Span &operator=(const Span &) = delete;
+
+  private:
+    const char *_name;
+    std::chrono::steady_clock::time_point _start;
+  };
+
+private:
+  static inline std::atomic<bool> _recording{false};
+
+  static void record(const char *name, std::chrono::steady_clock::time_point start,
+                     std::chrono::steady_clock::time_point end);
+};
+
 #endif
@@ -1,6 +1,8 @@
 #include "GameBoard.h"
 
+#include <chrono>
 #include <iostream>
+#include <span>
 #include <sstream>
 
 using namespace std;
@@ -19,7 +21,6 @@ string StatusLine(const GameBoard &board, bool highlightCoords, unsigned time) {
 }
 
 void GameBoardTestMain() {
-  bool done = false;
   bool highlightCoords = true;
   
   int myRow = 5;
@@ -27,10 +28,92 @@ void GameBoardTestMain() {
   unsigned time = 0;
   
   GameBoard board(20, 20);
+  GameLoop loop(board, chrono::milliseconds(100));
 
-  char cmd = noKey;
+  loop.run([&](span<const char> keys) {
+    board.clearTileAt(myRow, myCol);
+
+    for (char cmd : keys) {
+      // cout << "command key: ";
+      // GameBoard::printCommandKey(cmd);
+
+      switch (cmd) {
+        case GameBoard::arrowUpKey:
+          myRow = max(myRow - 1, 0);
+          break;
+        case GameBoard::arrowDownKey:
+          myRow = min(myRow + 1, (int)board.rowCount() - 1);
+          break;
+        case GameBoard::arrowRightKey:
+          myCol = min(myCol + 1, (int)board.colCount() - 1);
+          break;
+        case GameBoard::arrowLeftKey:
+          myCol = max(myCol - 1, 0);
+          break;
+        case GameBoard::arrowUpLeftKey:
+          if (myRow > 0 && myCol > 0) {
+            --myRow;
+            --myCol;
+          }
+          break;
+        case GameBoard::arrowUpRightKey:
+          if (myRow > 0 && myCol < board.colCount() - 1) {
+            --myRow;
+            ++myCol;
+          }
+          break;
+        case GameBoard::arrowDownLeftKey:
+          if (myRow < board.rowCount() - 1 && myCol > 0) {
+            ++myRow;
+            --myCol;
+          }
+          break;
+        case GameBoard::arrowDownRightKey:
+          if (myRow < board.rowCount() - 1 && myCol < board.colCount() - 1) {
+            ++myRow;
+            ++myCol;
+          }
+          break;
+        case 'C':
+          board.setDisplayCoords(!board.displayCoords());
+          break;
+        case 'D':
+          board.setDisplayEmptyTileDots(!board.displayEmptyTileDots());
+          break;
+        case 'H':
+          highlightCoords = !highlightCoords;
+          break;
+        case 'N':
+          board.setNethackKeyMode(!board.nethackKeyMode());
+          break;
+        case 'V':
+          board.setVT100Mode(!board.vt100Mode());
+          break;
+        case 'W':
+          board.setWASDKeyMode(!board.wasdKeyMode());
+          break;
+        case '0':
+        case '1':
+        case '2':
+        case '3':
+        case '4':
+        case '5':
+        case '6':
+        case '7':
+        case '8':
+        case '9':
+          board << "logging a digit: " << (cmd - '0') << endl;
+          break;
+        case 'q':
+        case 'Q':
+          loop.stop();
+          break;
+        default:
+          // My eyes! The goggles do nothing.
+          break;
+      }
+    }
 
-  while (!done) {
     board.setTileAt(myRow, myCol, '@', Color::red);
     
     if (highlightCoords) {
@@ -40,91 +123,6 @@ void GameBoardTestMain() {
     }
 
     board.setMessage(StatusLine(board, highlightCoords, time));
-
-    board.updateConsole();
-
-    board.clearTileAt(myRow, myCol);
     ++time;
-
-    // cout << "command key: ";
-    // GameBoard::printCommandKey(cmd);
-    
-    cmd = board.nextCommandKey();
-
-    switch (cmd) {
-      case arrowUpKey:
-        myRow = max(myRow - 1, 0);
-        break;
-      case arrowDownKey:
-        myRow = min(myRow + 1, (int)board.rowCount() - 1);
-        break;
-      case arrowRightKey:
-        myCol = min(myCol + 1, (int)board.colCount() - 1);
-        break;
-      case arrowLeftKey:
-        myCol = max(myCol - 1, 0);
-        break;
-      case arrowUpLeftKey:
-        if (myRow > 0 && myCol > 0) {
-          --myRow;
-          --myCol;
-        }
-        break;
-      case arrowUpRightKey:
-        if (myRow > 0 && myCol < board.colCount() - 1) {
-          --myRow;
-          ++myCol;
-        }
-        break;
-      case arrowDownLeftKey:
-        if (myRow < board.rowCount() - 1 && myCol > 0) {
-          ++myRow;
-          --myCol;
-        }
-        break;
-      case arrowDownRightKey:
-        if (myRow < board.rowCount() - 1 && myCol < board.colCount() - 1) {
-          ++myRow;
-          ++myCol;
-        }
-        break;
-      case 'C':
-        board.setDisplayCoords(!board.displayCoords());
-        break;
-      case 'D':
-        board.setDisplayEmptyTileDots(!board.displayEmptyTileDots());
-        break;
-      case 'H':
-        highlightCoords = !highlightCoords;
-        break;
-      case 'N':
-        board.setNethackKeyMode(!board.nethackKeyMode());
-        break;
-      case 'V':
-        board.setVT100Mode(!board.vt100Mode());
-        break;
-      case 'W':
-        board.setWASDKeyMode(!board.wasdKeyMode());
-        break;
-      case '0':
-      case '1':
-      case '2':
-      case '3':
-      case '4':
-      case '5':
-      case '6':
-      case '7':
-      case '8':
-      case '9':
-        board << "logging a digit: " << (cmd - '0') << endl;
-        break;
-case 'q':
-      case 'Q':
-        done = true;
-        break;
-     default:
-        // My eyes! The goggles do nothing.
-        break;
-    }
-  }
+  });
 }
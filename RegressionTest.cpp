@@ -0,0 +1,265 @@
+#include "GameBoard.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Checks for bugs that have been fixed, each printing whether it passed.
+static int sFailureCount = 0;
+
+static void Check(const char *name, bool passed) {
+  cout << (passed ? "PASS " : "FAIL ") << name << endl;
+  if (!passed) {
+    ++sFailureCount;
+  }
+}
+
+// A board without rows is drawn as just its border, serially or not.
+static void EmptyBoardTest() {
+  for (int threadCount : {0, 1, 4}) {
+    GameBoard board(0, 5);
+    HeadlessTerminal terminal;
+    board.setRenderSink(&terminal);
+    board.setEncodingThreadCount(threadCount);
+    board.updateConsole();
+    board.redrawConsole();
+    Check("empty board draws", board.screenMatches(terminal));
+  }
+}
+
+// A key bound to noKey is ignored, while the keys typed after it aren't.
+static void IgnoredKeyTest() {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    Check("ignored key pipe", false);
+    return;
+  }
+
+  GameBoard board;
+  board.setInputFileDescriptor(fds[0]);
+  board.setKeyBinding('x', GameBoard::noKey);
+
+  write(fds[1], "xa", 2);
+  vector<char> keys;
+  board.pollKeys(keys);
+  Check("pollKeys skips ignored key", keys == vector<char>{'a'});
+
+  write(fds[1], "xb", 2);
+  Check("tryNextKey skips ignored key", board.tryNextKey() == 'b');
+
+  write(fds[1], "xc", 2);
+  auto start = chrono::steady_clock::now();
+  char key = board.nextCommandKeyFor(chrono::milliseconds(300));
+  Check("nextCommandKeyFor skips ignored key",
+        key == 'c' &&
+            chrono::steady_clock::now() - start < chrono::milliseconds(100));
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// Non-ASCII chars, typed or pasted, come back as nonASCIIKeys, never as the
+// special keys their UTF-8 bytes share values with, e.g. pasteEndKey.
+static void NonASCIIPasteTest() {
+  KeyDecoder decoder;
+  string input = "\xC3\xA9\x1B[200~h\xC3\xA9\xC3\xA8\xC3\x81\xE2\x82\xAC!\x1B[201~x";
+  vector<char> keys;
+  for (size_t i = 0; i < input.size();) {
+    char key;
+    if (decoder.decode(input[i], key)) {
+      ++i;
+    }
+    if (key != GameBoard::noKey) {
+      keys.push_back(key);
+    }
+  }
+
+  vector<char> expectedKeys = {
+      GameBoard::nonASCIIKey, GameBoard::pasteStartKey, 'h',
+      GameBoard::nonASCIIKey, GameBoard::nonASCIIKey,   GameBoard::nonASCIIKey,
+      GameBoard::nonASCIIKey, '!',                      GameBoard::pasteEndKey,
+      'x'};
+  Check("non-ASCII paste decodes", keys == expectedKeys);
+}
+
+// Binding a special key doesn't rebind the non-ASCII chars whose UTF-8 bytes
+// share its value, e.g. arrowUpKey's 0x81 in "Á".
+static void SpecialKeyBindingTest() {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    Check("special key binding pipe", false);
+    return;
+  }
+
+  GameBoard board;
+  board.setInputFileDescriptor(fds[0]);
+  board.setKeyBinding(GameBoard::arrowUpKey, 'k');
+
+  write(fds[1], "\x1B[A\xC3\x81", 5);
+  vector<char> keys;
+  board.pollKeys(keys);
+  Check("special key binding is its own",
+        keys == vector<char>{'k', GameBoard::nonASCIIKey});
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// Rebinding a key replaces its binding, whether set or loaded.
+static void RebindKeyTest() {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    Check("rebind key pipe", false);
+    return;
+  }
+
+  GameBoard board;
+  board.setInputFileDescriptor(fds[0]);
+  for (char commandKey : {'a', 'b', char(GameBoard::noKey), 'c'}) {
+    board.setKeyBinding('x', commandKey);
+  }
+  board.loadKeyBindings("y = d\ny = e\n");
+  board.loadKeyBindings("y = f\n");
+  board.setKeyBinding('z', 'g');
+  board.loadKeyBindings("z = h\n");
+
+  write(fds[1], "xyz", 3);
+  vector<char> keys;
+  board.pollKeys(keys);
+  Check("rebinding replaces the binding", keys == vector<char>{'c', 'f', 'h'});
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// Keys written at once are all read when the file descriptor is readable, so
+// an event loop has to drain them, not wait for it to be readable again.
+static void BufferedKeysTest() {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    Check("buffered keys pipe", false);
+    return;
+  }
+
+  GameBoard board;
+  board.setInputFileDescriptor(fds[0]);
+  write(fds[1], "abcd", 4);
+
+  struct pollfd pollFD = {fds[0], POLLIN, 0};
+  bool readable = poll(&pollFD, 1, 1000) == 1;
+  char firstKey = board.tryNextKey();
+  bool stillReadable = poll(&pollFD, 1, 0) == 1;
+  Check("first key of a burst", readable && firstKey == 'a');
+  Check("rest of the burst buffered", !stillReadable && board.hasBufferedKeys());
+
+  string keys;
+  while (char key = board.tryNextKey()) {
+    keys += key;
+  }
+  Check("one readiness event delivers the burst",
+        keys == "bcd" && !board.hasBufferedKeys());
+
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// An AsyncRenderer copies just the viewport of a large board, and draws it,
+// coords and all, as the board would itself.
+static void AsyncViewportTest() {
+  GameBoard board(1000, 1000);
+  board.setViewportSize(20, 30);
+  HeadlessTerminal asyncTerminal;
+  board.setRenderSink(&asyncTerminal);
+  {
+    AsyncRenderer renderer(board);
+    for (int frame = 0; frame < 300; ++frame) {
+      int row = (frame * 37) % 1000, col = (frame * 91) % 1000;
+      board.setTileAt(row, col, char('a' + frame % 26), Color(frame % 12));
+      board.setViewport(min(row, 980), min(col, 970));
+      board.setHighlightedCoords(row, col);
+      if (frame == 150) {
+        board.setViewportSize(15, 25);
+      }
+      renderer.present();
+
+      // Waiting for each frame to be drawn has every change drawn as one.
+      while (renderer.renderedCount() + renderer.skippedCount() <
+             renderer.presentedCount()) {
+        this_thread::yield();
+      }
+    }
+  }
+
+  HeadlessTerminal terminal;
+  board.setRenderSink(&terminal);
+  board.updateConsole();
+  bool same = board.screenMatches(asyncTerminal);
+  for (int row = 0; row < terminal.rowCount(); ++row) {
+    same = same && asyncTerminal.rowText(row) == terminal.rowText(row);
+  }
+  Check("async renderer draws the viewport", same);
+}
+
+// Waiting for the rest of an escape sequence doesn't overrun the deadline, and
+// a signal doesn't end an indefinite wait for a key.
+static void KeyWaitTest() {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    Check("key wait pipe", false);
+    return;
+  }
+
+  GameBoard board;
+  board.setInputFileDescriptor(fds[0]);
+
+  write(fds[1], "\x1B", 1);
+  auto start = chrono::steady_clock::now();
+  char key = board.nextCommandKeyFor(chrono::milliseconds(5));
+  Check("pending escape keeps the deadline",
+        key == GameBoard::noKey &&
+            chrono::steady_clock::now() - start < chrono::milliseconds(30));
+  Check("lone escape key returned later",
+        board.nextCommandKeyFor(chrono::milliseconds(500)) ==
+            GameBoard::escapeKey);
+
+  // Without SA_RESTART, so the signal interrupts the wait.
+  struct sigaction action = {};
+  struct sigaction previousAction;
+  action.sa_handler = [](int) {};
+  sigaction(SIGUSR1, &action, &previousAction);
+
+  pthread_t waitingThread = pthread_self();
+  thread typist([&] {
+    this_thread::sleep_for(chrono::milliseconds(50));
+    pthread_kill(waitingThread, SIGUSR1);
+    this_thread::sleep_for(chrono::milliseconds(50));
+    write(fds[1], "k", 1);
+  });
+  Check("signal doesn't end the wait", board.nextCommandKey(0) == 'k');
+  typist.join();
+
+  sigaction(SIGUSR1, &previousAction, nullptr);
+  close(fds[0]);
+  close(fds[1]);
+}
+
+void RegressionTestMain() {
+  EmptyBoardTest();
+  IgnoredKeyTest();
+  NonASCIIPasteTest();
+  SpecialKeyBindingTest();
+  RebindKeyTest();
+  BufferedKeysTest();
+  AsyncViewportTest();
+  KeyWaitTest();
+  cout << (sFailureCount ? "FAILED" : "PASSED") << endl;
+}
@@ -8,21 +8,27 @@ using namespace std;
 void SimpleTestMain() {
   GameBoard board(20, 15);
 
-  bool done = false;
+  // Moves the @ 5 times a second, redrawing up to 30 times a second.
+  GameLoop loop(board, chrono::milliseconds(200), chrono::milliseconds(33));
+
   int row = 5, col = 3;
-  while (!done) {
-    // Sets a char at a position with a color.
-    board.setTileAt(row, col, '@', Color::magenta);
-    // Draws all tiles, or all that changed since the last draw().
-    board.updateConsole();
+  // Sets a char at a position with a color.
+  board.setTileAt(row, col, '@', Color::magenta);
 
+  // Called every 0.2s with the keys pressed since the last call. The loop
+  // draws all tiles, or all that changed since the last draw, in between.
+  loop.run([&](span<const char> keys) {
     // Erases the tile at row, col (providing the illusion of motion).
     board.clearTileAt(row, col);
     // The board can answer its height and width.
     row = (row + 1) % board.rowCount();
     col = (col + 1) % board.colCount();
-    // Wait 0.2s for user input (the param / 10 seconds).
-    char cmd = board.nextCommandKey(2);
-    done = cmd == 'q' || cmd == 'Q';
-  }
-}
\ No newline at end of file
+    board.setTileAt(row, col, '@', Color::magenta);
+
+    for (char cmd : keys) {
+      if (cmd == 'q' || cmd == 'Q') {
+        loop.stop();
+      }
+    }
+  });
+}
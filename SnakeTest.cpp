@@ -1,7 +1,9 @@
 #include "GameBoard.h"
 
-#include <algorithm>>
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <span>
 #include <sstream>
 
 using namespace std;
@@ -40,7 +42,6 @@ SnakeNode *RemoveLastNode(SnakeNode *head) {
 
 void SnakeTestMain() {
   bool killed = false;
-  bool gameOver = false;
   bool highlightCoords = true;
   int dr = 0;
   int dc = 1;
@@ -64,75 +65,57 @@ void SnakeTestMain() {
     firstNode = NewFirstNode(snake, firstNode->row + dr, firstNode->col + dc);
   }
 
+  // The snake moves 5 times a second, however often keys are pressed.
+  GameLoop loop(board, chrono::milliseconds(200));
+
   cout << "Press Any Key to Start\n";
   board.nextCommandKey(0);
   
-  while (!gameOver) {
-    
-    char firstGlyph = killed ? 'X' : '@';
-    board.setTileAt(firstNode->row, firstNode->col, firstGlyph, Color::red);
-    SnakeNode *node = firstNode->next;
-    while (node != nullptr) {
-      board.setTileAt(node->row, node->col, 'o', Color::red);
-      node = node->next;
-    }
-    
-    if (highlightCoords) {
-      board.setHighlightedCoords(firstNode->row, firstNode->col);
-    } else {
-      board.setHighlightedCoords();
-    }
-
-    board.updateConsole();
-
-    if (killed) {
-      break;
-    }
-    
-    char cmd = board.nextCommandKey(2);
-
-    switch (cmd) {
-      case arrowUpKey:
-        dr = max(-1, dr - 1);
-        dc = 0;
-        break;
-      case arrowDownKey:
-        dr = min(1, dr + 1);
-        dc = 0;
-        break;
-      case arrowRightKey:
-        dc = min(1, dc + 1);
-        dr = 0;
-        break;
-      case arrowLeftKey:
-        dc = max(-1, dc - 1);
-        dr = 0;
-        break;
-      case 'C':
-        board.setDisplayCoords(!board.displayCoords());
-        break;
-      case 'D':
-        board.setDisplayEmptyTileDots(!board.displayEmptyTileDots());
-        break;
-      case 'H':
-        highlightCoords = !highlightCoords;
-        break;
-      case 'N':
-        board.setNethackKeyMode(!board.nethackKeyMode());
-        break;
-      case 'V':
-        board.setVT100Mode(!board.vt100Mode());
-        break;
-      case 'W':
-        board.setWASDKeyMode(!board.wasdKeyMode());
-        break;
-      case 'q':
-      case 'Q':
-        gameOver = true;
-        break;
-     default:
-        // My eyes! The goggles do nothing.
-        break;
+  loop.run([&](span<const char> keys) {
+    for (char cmd : keys) {
+      switch (cmd) {
+        case GameBoard::arrowUpKey:
+          dr = max(-1, dr - 1);
+          dc = 0;
+          break;
+        case GameBoard::arrowDownKey:
+          dr = min(1, dr + 1);
+          dc = 0;
+          break;
+        case GameBoard::arrowRightKey:
+          dc = min(1, dc + 1);
+          dr = 0;
+          break;
+        case GameBoard::arrowLeftKey:
+          dc = max(-1, dc - 1);
+          dr = 0;
+          break;
+        case 'C':
+          board.setDisplayCoords(!board.displayCoords());
+          break;
+        case 'D':
+          board.setDisplayEmptyTileDots(!board.displayEmptyTileDots());
+          break;
+        case 'H':
+          highlightCoords = !highlightCoords;
+          break;
+        case 'N':
+          board.setNethackKeyMode(!board.nethackKeyMode());
+          break;
+        case 'V':
+          board.setVT100Mode(!board.vt100Mode());
+          break;
+        case 'W':
+          board.setWASDKeyMode(!board.wasdKeyMode());
+          break;
+        case 'q':
+        case 'Q':
+          loop.stop();
+          return;
+        default:
+          // My eyes! The goggles do nothing.
+          break;
+      }
     }
 
     int nextRow = firstNode->row + dr;
@@ -149,9 +132,29 @@ void SnakeTestMain() {
     } else {
       killed = true;
     }
-  }
+
+    char firstGlyph = killed ? 'X' : '@';
+    board.setTileAt(firstNode->row, firstNode->col, firstGlyph, Color::red);
+    SnakeNode *node = firstNode->next;
+    while (node != nullptr) {
+      board.setTileAt(node->row, node->col, 'o', Color::red);
+      node = node->next;
+    }
+    
+    if (highlightCoords) {
+      board.setHighlightedCoords(firstNode->row, firstNode->col);
+    } else {
+      board.setHighlightedCoords();
+    }
+
+    if (killed) {
+      loop.stop();
+    }
+  });
 
   if (killed) {
+    // The loop doesn't draw after it's stopped.
+    board.updateConsole();
     cout << "snake killed\n";
   }
-}
\ No newline at end of file
+}
@@ -3,10 +3,14 @@
 void GameBoardTestMain();
 void SimpleTestMain();
 void SnakeTestMain();
+void BenchmarkTestMain();
+void RegressionTestMain();
 
 int main() {
   GameBoardTestMain();
   // SnakeTestMain();
   // SimpleTestMain();
+  // BenchmarkTestMain();
+  // RegressionTestMain();
   return 0;
 }